@@ -0,0 +1,447 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+// Microbenchmarks for the parts of the amx_* API that the runner and plugins
+// use all the time. The scripts are generated in memory, in three sizes, so
+// that no Pawn compiler is needed and the numbers don't depend on what some
+// compiler version happens to emit.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "native.h"
+#include "amx/amx.h"
+#include "amx/amxaux.h"
+
+namespace {
+
+// Opcodes used by the generated code; amx.c keeps its opcode list private.
+enum Opcode {
+  OP_LOAD_S_PRI = 3,
+  OP_PUSH_C = 39,
+  OP_STACK = 44,
+  OP_PROC = 46,
+  OP_RETN = 48,
+  OP_ZERO_PRI = 89,
+  OP_HALT = 120,
+  OP_SYSREQ_C = 123,
+  OP_NOP = 134
+};
+
+// Builds a compiled script image in the file format read by amx_Init().
+class Image {
+ public:
+  Image(): data_size_(0), stack_size_(16384) {
+    // Every call returns to address 0, where the code halts.
+    code_ = {OP_HALT, 0};
+  }
+
+  cell AddFunction(const std::vector<cell> &code) {
+    auto address = static_cast<cell>(code_.size() * sizeof(cell));
+    code_.insert(code_.end(), code.begin(), code.end());
+    return address;
+  }
+
+  void AddPublic(const std::string &name, cell address) {
+    publics_.emplace_back(name, address);
+  }
+
+  int AddNative(const std::string &name) {
+    natives_.push_back(name);
+    return static_cast<int>(natives_.size() - 1);
+  }
+
+  void SetDataSize(int cells) { data_size_ = cells; }
+
+  // Returns the image with room for the stack and heap at the end.
+  std::vector<unsigned char> Build() const {
+    // amx_FindPublic() and amx_FindNative() do a binary search.
+    auto publics = publics_;
+    std::sort(publics.begin(), publics.end());
+
+    AMX_HEADER hdr = {};
+    hdr.magic = AMX_MAGIC;
+    hdr.file_version = CUR_FILE_VERSION;
+    hdr.amx_version = MIN_AMX_VERSION;
+    hdr.defsize = sizeof(AMX_FUNCSTUBNT);
+    hdr.publics = sizeof(AMX_HEADER);
+    hdr.natives = hdr.publics + static_cast<int32_t>(
+      publics.size() * sizeof(AMX_FUNCSTUBNT));
+    hdr.libraries = hdr.natives + static_cast<int32_t>(
+      natives_.size() * sizeof(AMX_FUNCSTUBNT));
+    hdr.pubvars = hdr.libraries;
+    hdr.tags = hdr.libraries;
+    hdr.nametable = hdr.libraries;
+
+    // The name table starts with the length of the longest name.
+    std::vector<unsigned char> names(sizeof(uint16_t));
+    std::vector<AMX_FUNCSTUBNT> entries;
+    uint16_t max_length = 0;
+    auto add_name = [&](const std::string &name, cell address) {
+      AMX_FUNCSTUBNT entry;
+      entry.address = address;
+      entry.nameofs = static_cast<uint32_t>(hdr.nametable + names.size());
+      entries.push_back(entry);
+      names.insert(names.end(), name.begin(), name.end());
+      names.push_back('\0');
+      max_length = std::max(max_length, static_cast<uint16_t>(name.length()));
+    };
+    for (auto &p : publics) {
+      add_name(p.first, p.second);
+    }
+    for (auto &name : natives_) {
+      add_name(name, 0);
+    }
+    std::memcpy(names.data(), &max_length, sizeof(max_length));
+    names.resize((names.size() + sizeof(cell) - 1) / sizeof(cell)
+                 * sizeof(cell));
+
+    hdr.cod = hdr.nametable + static_cast<int32_t>(names.size());
+    hdr.dat = hdr.cod + static_cast<int32_t>(code_.size() * sizeof(cell));
+    hdr.hea = hdr.dat + data_size_ * static_cast<int32_t>(sizeof(cell));
+    hdr.stp = hdr.hea + stack_size_;
+    hdr.size = hdr.hea;
+    hdr.cip = -1;
+
+    std::vector<unsigned char> image(hdr.stp);
+    std::memcpy(image.data(), &hdr, sizeof(hdr));
+    std::memcpy(image.data() + hdr.publics, entries.data(),
+                entries.size() * sizeof(AMX_FUNCSTUBNT));
+    std::memcpy(image.data() + hdr.nametable, names.data(), names.size());
+    std::memcpy(image.data() + hdr.cod, code_.data(),
+                code_.size() * sizeof(cell));
+    return image;
+  }
+
+ private:
+  std::vector<cell> code_;
+  std::vector<std::pair<std::string, cell>> publics_;
+  std::vector<std::string> natives_;
+  int data_size_;
+  int stack_size_;
+};
+
+cell AMX_NATIVE_CALL n_dummy(AMX *amx, const cell *params) {
+  return 0;
+}
+
+// A native written by hand, as in amxcore.c.
+cell AMX_NATIVE_CALL n_add_raw(AMX *amx, const cell *params) {
+  if (params[0] != 2 * static_cast<cell>(sizeof(cell))) {
+    amx_RaiseError(amx, AMX_ERR_PARAMS);
+    return 0;
+  }
+  return params[1] + params[2];
+}
+
+// The same native written with native.h.
+cell n_add_typed(AMX *amx, cell a, cell b) {
+  return a + b;
+}
+
+struct ScriptSize {
+  const char *label;
+  int num_publics;
+  int num_natives;
+  int code_cells;
+};
+
+const ScriptSize SCRIPT_SIZES[] = {
+  {"small", 16, 16, 1024},
+  {"medium", 256, 256, 65536},
+  {"large", 4096, 4096, 1048576}
+};
+
+const char STRING[] = "The quick brown fox jumps over the lazy dog 0123456789";
+
+class Script {
+ public:
+  explicit Script(const ScriptSize &size) {
+    Image image;
+    cell empty = image.AddFunction({OP_PROC, OP_ZERO_PRI, OP_RETN});
+    cell first_arg = image.AddFunction({OP_PROC, OP_LOAD_S_PRI, 12, OP_RETN});
+    int add_raw = image.AddNative("add_raw");
+    int add_typed = image.AddNative("add_typed");
+    cell call_raw = image.AddFunction({
+      OP_PROC,
+      OP_PUSH_C, 2, OP_PUSH_C, 1, OP_PUSH_C, 2 * sizeof(cell),
+      OP_SYSREQ_C, add_raw,
+      OP_STACK, 3 * sizeof(cell),
+      OP_RETN
+    });
+    cell call_typed = image.AddFunction({
+      OP_PROC,
+      OP_PUSH_C, 2, OP_PUSH_C, 1, OP_PUSH_C, 2 * sizeof(cell),
+      OP_SYSREQ_C, add_typed,
+      OP_STACK, 3 * sizeof(cell),
+      OP_RETN
+    });
+    image.AddPublic("empty", empty);
+    image.AddPublic("first_arg", first_arg);
+    image.AddPublic("call_raw", call_raw);
+    image.AddPublic("call_typed", call_typed);
+
+    // Filler to bring the script up to size: publics and natives with
+    // similar names, and code that amx_Init() has to go through.
+    std::vector<cell> filler(size.code_cells, OP_NOP);
+    filler.front() = OP_PROC;
+    filler.back() = OP_RETN;
+    image.AddFunction(filler);
+    char name[sNAMEMAX + 1];
+    for (int i = 0; i < size.num_publics; i++) {
+      std::snprintf(name, sizeof(name), "OnPublic%05d", i);
+      image.AddPublic(name, empty);
+      public_names_.push_back(name);
+    }
+    natives_.push_back({"add_raw", n_add_raw});
+    natives_.push_back({"add_typed", NATIVE_WRAPPER(n_add_typed)});
+    for (int i = 0; i < size.num_natives; i++) {
+      std::snprintf(name, sizeof(name), "native%05d", i);
+      image.AddNative(name);
+      native_names_.push_back(name);
+    }
+    for (auto &native_name : native_names_) {
+      natives_.push_back({native_name.c_str(), n_dummy});
+    }
+    image.SetDataSize(256);
+    image_ = image.Build();
+  }
+
+  ~Script() {
+    if (amx_.base != nullptr) {
+      amx_Cleanup(&amx_);
+    }
+  }
+
+  bool Init() {
+    program_ = image_;
+    std::memset(&amx_, 0, sizeof(amx_));
+    int error = amx_Init(&amx_, program_.data());
+    if (error == AMX_ERR_NONE) {
+      error = amx_Register(&amx_, natives_.data(),
+                           static_cast<int>(natives_.size()));
+    }
+    if (error != AMX_ERR_NONE) {
+      std::fprintf(stderr, "amx_Init failed: %s\n", aux_StrError(error));
+      return false;
+    }
+    return true;
+  }
+
+  // Clears the addresses in the native table so that amx_Register() has to
+  // look up every native again.
+  void UnregisterNatives() {
+    auto hdr = reinterpret_cast<AMX_HEADER *>(amx_.base);
+    auto entries = reinterpret_cast<AMX_FUNCSTUBNT *>(amx_.base + hdr->natives);
+    int num_natives = (hdr->libraries - hdr->natives) / hdr->defsize;
+    for (int i = 0; i < num_natives; i++) {
+      entries[i].address = 0;
+    }
+    amx_.flags &= ~AMX_FLAG_NTVREG;
+  }
+
+  bool Save(const std::string &path) const {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    auto hdr = reinterpret_cast<const AMX_HEADER *>(image_.data());
+    bool ok = std::fwrite(image_.data(), hdr->size, 1, file) == 1;
+    return std::fclose(file) == 0 && ok;
+  }
+
+  AMX *amx() { return &amx_; }
+  const std::vector<std::string> &public_names() const { return public_names_; }
+  const std::vector<std::string> &native_names() const { return native_names_; }
+  const std::vector<AMX_NATIVE_INFO> &natives() const { return natives_; }
+
+ private:
+  std::vector<unsigned char> image_;
+  std::vector<unsigned char> program_;
+  std::vector<std::string> public_names_;
+  std::vector<std::string> native_names_;
+  std::vector<AMX_NATIVE_INFO> natives_;
+  AMX amx_ = {};
+};
+
+using Clock = std::chrono::steady_clock;
+
+const auto MIN_BATCH_TIME = std::chrono::milliseconds(20);
+const int NUM_BATCHES = 5;
+
+// Reports the median time per call over a few batches, each long enough to
+// time reliably.
+void Run(const char *name, const char *size, std::function<void()> body) {
+  auto min_batch_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    MIN_BATCH_TIME).count();
+  auto time_batch = [&body](long iterations) {
+    auto start = Clock::now();
+    for (long i = 0; i < iterations; i++) {
+      body();
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count();
+  };
+
+  long iterations = 1;
+  while (time_batch(iterations) < min_batch_time) {
+    iterations *= 2;
+  }
+  std::vector<double> times;
+  for (int i = 0; i < NUM_BATCHES; i++) {
+    times.push_back(static_cast<double>(time_batch(iterations)) / iterations);
+  }
+  std::sort(times.begin(), times.end());
+  std::printf("%-32s %-8s %14.1f ns\n", name, size, times[NUM_BATCHES / 2]);
+}
+
+void RunBenchmarks(const ScriptSize &size, const std::string &temp_path) {
+  Script script(size);
+  if (!script.Init()) {
+    return;
+  }
+  AMX *amx = script.amx();
+  const char *label = size.label;
+
+  // Look up names spread over the whole table.
+  const auto &public_names = script.public_names();
+  std::size_t next_public = 0;
+  Run("amx_FindPublic", label, [&] {
+    int index;
+    const auto &name = public_names[next_public];
+    next_public = (next_public + 97) % public_names.size();
+    amx_FindPublic(amx, name.c_str(), &index);
+  });
+  const auto &native_names = script.native_names();
+  std::size_t next_native = 0;
+  Run("amx_FindNative", label, [&] {
+    int index;
+    const auto &name = native_names[next_native];
+    next_native = (next_native + 97) % native_names.size();
+    amx_FindNative(amx, name.c_str(), &index);
+  });
+
+  // Arguments that are pushed and then dropped without a call.
+  Run("amx_Push/PushString/Release", label, [amx] {
+    cell stk = amx->stk;
+    cell amx_addr;
+    amx_PushString(amx, &amx_addr, nullptr, STRING, 0, 0);
+    amx_Push(amx, 1);
+    amx_Push(amx, 2);
+    amx_Release(amx, amx_addr);
+    amx->stk = stk;
+    amx->paramcount = 0;
+  });
+
+  int empty;
+  amx_FindPublic(amx, "empty", &empty);
+  Run("amx_Exec (empty public)", label, [amx, empty] {
+    amx_Exec(amx, nullptr, empty);
+  });
+
+  // The two ways CallLocalFunction() has called publics with arguments: a
+  // lookup and one amx_Push() per argument, and a cached index with all
+  // arguments pushed at once.
+  const cell args[4] = {1, 2, 3, 4};
+  Run("call: FindPublic+Push+Exec", label, [amx, &args] {
+    int index;
+    amx_FindPublic(amx, "first_arg", &index);
+    for (int i = 3; i >= 0; i--) {
+      amx_Push(amx, args[i]);
+    }
+    amx_Exec(amx, nullptr, index);
+  });
+  int first_arg;
+  amx_FindPublic(amx, "first_arg", &first_arg);
+  Run("call: cached PushArgs+Exec", label, [amx, first_arg, &args] {
+    amx_PushArgs(amx, args, 4);
+    amx_Exec(amx, nullptr, first_arg);
+  });
+  // The same call through a prepared handle, which skips the entry checks
+  // and the public table lookup in amx_Exec().
+  AMX_CALL call;
+  amx_PrepareCall(amx, "first_arg", &call);
+  Run("call: PrepareCall+ExecCall", label, [&call, &args] {
+    amx_ExecCall(&call, nullptr, args, 4);
+  });
+
+  // A native written by hand and the same native written with native.h,
+  // each called from a public.
+  int call_raw;
+  int call_typed;
+  amx_FindPublic(amx, "call_raw", &call_raw);
+  amx_FindPublic(amx, "call_typed", &call_typed);
+  Run("native call (hand-written)", label, [amx, call_raw] {
+    amx_Exec(amx, nullptr, call_raw);
+  });
+  Run("native call (native.h)", label, [amx, call_typed] {
+    amx_Exec(amx, nullptr, call_typed);
+  });
+
+  cell *string;
+  amx_GetAddr(amx, 0, &string);
+  char buffer[sizeof(STRING)];
+  Run("amx_SetString", label, [string] {
+    amx_SetString(string, STRING, 0, 0, sizeof(STRING));
+  });
+  Run("amx_GetString", label, [string, &buffer] {
+    amx_GetString(buffer, string, 0, sizeof(buffer));
+  });
+
+  const auto &natives = script.natives();
+  Run("amx_Register (all natives)", label, [&script, amx, &natives] {
+    script.UnregisterNatives();
+    amx_Register(amx, natives.data(), static_cast<int>(natives.size()));
+  });
+
+  if (!script.Save(temp_path)) {
+    std::fprintf(stderr, "Could not write %s\n", temp_path.c_str());
+    return;
+  }
+  Run("aux_LoadProgram", label, [&temp_path] {
+    AMX loaded = {};
+    if (aux_LoadProgram(&loaded, temp_path.c_str(), nullptr)
+        == AMX_ERR_NONE) {
+      aux_FreeProgram(&loaded);
+    }
+  });
+  std::remove(temp_path.c_str());
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  std::string temp_path = argc > 1 ? argv[1] : "amx-bench.amx";
+  std::printf("%-32s %-8s %14s\n", "benchmark", "script", "time per call");
+  for (const auto &size : SCRIPT_SIZES) {
+    RunBenchmarks(size, temp_path);
+  }
+  return EXIT_SUCCESS;
+}
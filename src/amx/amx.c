@@ -70,6 +70,16 @@
   #include <windows.h>
 #endif
 
+/* The string functions have SSE2 versions that handle four cells (or sixteen
+ * characters) per step. Define AMX_NOSIMD to force the plain loops.
+ */
+#if !defined AMX_NOSIMD && PAWN_CELL_SIZE==32 && BYTE_ORDER==LITTLE_ENDIAN
+  #if defined __SSE2__ || defined _M_X64 || defined _M_AMD64 || (defined _M_IX86_FP && _M_IX86_FP>=2)
+    #define AMX_SSE2
+    #include <emmintrin.h>
+  #endif
+#endif
+
 
 /* When one or more of the AMX_funcname macris are defined, we want
  * to compile only those functions. However, when none of these macros
@@ -272,6 +282,35 @@ typedef enum {
   OP_NUM_OPCODES
 } OPCODE;
 
+#if defined _MSC_VER
+  #define THREADLOCAL   __declspec(thread)
+#else
+  #define THREADLOCAL   __thread
+#endif
+
+#if defined AMX_COUNT_INSTRUCTIONS
+  /* the number of instructions amx_Exec() executed on this thread; each
+   * thread runs its own abstract machines, so a thread-local counter needs
+   * no locking
+   */
+  static THREADLOCAL uint64_t amx_instructions;
+  #define COUNT_INSTRUCTION()   (amx_instructions++)
+#else
+  #define COUNT_INSTRUCTION()   ((void)0)
+#endif
+
+/* the interrupt handler is global rather than per abstract machine, so that
+ * the check in amx_Exec() is a single load; amx_Interrupt() may set the flag
+ * from any thread
+ */
+static AMX_INTERRUPT amx_interrupt_handler=NULL;
+static volatile int amx_interrupt_pending=0;
+
+/* the instruction budget for the next amx_Exec() on this thread, see
+ * amx_SetBudget()
+ */
+static THREADLOCAL long amx_budget;
+
 #define USENAMETABLE(hdr) \
                         ((hdr)->defsize==sizeof(AMX_FUNCSTUBNT))
 #define NUMENTRIES(hdr,field,nextfield) \
@@ -1662,6 +1701,77 @@ int AMXAPI amx_PushString(AMX *amx, cell *amx_addr, cell **phys_addr, const char
   return err;
 }
 
+/* amx_PushArgs() pushes a complete argument list at once, with a single
+ * check of the stack margin. The arguments are in the order of the function
+ * declaration; args[0] ends up at the top of the stack.
+ */
+int AMXAPI amx_PushArgs(AMX *amx, const cell args[], int numargs)
+{
+  AMX_HEADER *hdr;
+  unsigned char *data;
+
+  assert(amx!=NULL);
+  assert(args!=NULL || numargs==0);
+
+  if (numargs<0)
+    return AMX_ERR_PARAMS;
+  if (amx->hea+STKMARGIN+(cell)(numargs*sizeof(cell))>amx->stk)
+    return AMX_ERR_STACKERR;
+  hdr=(AMX_HEADER *)amx->base;
+  data=(amx->data!=NULL) ? amx->data : amx->base+(int)hdr->dat;
+  amx->stk-=numargs*sizeof(cell);
+  amx->paramcount+=numargs;
+  if (numargs>0)
+    memcpy(data+(int)amx->stk,args,numargs*sizeof(cell));
+  return AMX_ERR_NONE;
+}
+
+/* amx_PrepareCall() looks up a public function once, so that it can be
+ * called many times through amx_ExecCall() without a name lookup. The handle
+ * keeps the code address of the function, and amx_ExecCall() enters
+ * amx_Exec() with AMX_EXEC_CALL to skip the checks that were made here.
+ */
+#define AMX_EXEC_CALL   -3      /* start at amx->cip, set by amx_ExecCall() */
+
+int AMXAPI amx_PrepareCall(AMX *amx, const char *funcname, AMX_CALL *call)
+{
+  AMX_HEADER *hdr;
+  AMX_FUNCSTUB *func;
+  int err;
+
+  assert(amx!=NULL);
+  assert(funcname!=NULL);
+  assert(call!=NULL);
+
+  call->amx=NULL;
+  call->index=-1;
+  call->address=0;
+  if (amx->callback==NULL)
+    return AMX_ERR_CALLBACK;
+  if ((amx->flags & AMX_FLAG_RELOC)==0)
+    return AMX_ERR_INIT;
+  if ((err=amx_FindPublic(amx,funcname,&call->index))!=AMX_ERR_NONE)
+    return err;
+  hdr=(AMX_HEADER *)amx->base;
+  func=GETENTRY(hdr,publics,call->index);
+  call->amx=amx;
+  call->address=func->address;
+  return AMX_ERR_NONE;
+}
+
+int AMXAPI amx_ExecCall(const AMX_CALL *call, cell *retval, const cell args[], int numargs)
+{
+  int err;
+
+  assert(call!=NULL);
+  if (call->amx==NULL)
+    return AMX_ERR_INDEX;
+  if ((err=amx_PushArgs(call->amx,args,numargs))!=AMX_ERR_NONE)
+    return err;
+  call->amx->cip=call->address;
+  return amx_Exec(call->amx,retval,AMX_EXEC_CALL);
+}
+
 int AMXAPI amx_RaiseExecError(AMX *amx, cell index, cell *retval, int error) {
   AMX_EXEC_ERROR handler;
 
@@ -1706,12 +1816,62 @@ int AMXAPI amx_SetExecErrorHandler(AMX *amx, AMX_EXEC_ERROR handler) {
 #define CHKSTACK()      if (stk>amx->stp) ABORT(amx, AMX_ERR_STACKLOW)
 #define CHKHEAP()       if (hea<amx->hlw) ABORT(amx, AMX_ERR_HEAPLOW)
 
+/* SUSPEND() saves all registers and leaves amx_Exec() with AMX_ERR_SLEEP, so
+ * that the call continues at the current instruction with AMX_EXEC_CONT
+ */
+#define SUSPEND()       { amx->cip=(cell)((unsigned char *)cip-code);\
+                          amx->frm=frm;\
+                          amx->stk=stk;\
+                          amx->hea=hea;\
+                          amx->pri=pri;\
+                          amx->alt=alt;\
+                          amx->reset_stk=reset_stk;\
+                          amx->reset_hea=reset_hea;\
+                          return AMX_ERR_SLEEP; }
+
+/* JUMPTO() moves cip to a jump target. A backward jump uses up the budget in
+ * proportion to the code it goes back over (a cell of code is taken for an
+ * instruction), so every loop iteration is paid for while straight-line code
+ * is free; once the budget runs out, the call is suspended at the target
+ */
+#define JUMPTO(target)  do { cell *jt=(target);\
+                          if (budget>0 && jt<cip) {\
+                            budget-=(long)(cip-jt);\
+                            cip=jt;\
+                            if (budget<=0)\
+                              SUSPEND();\
+                          } else {\
+                            cip=jt;\
+                          }\
+                        } while (0)
+
+/* CHKBUDGET() charges a function call to the budget */
+#define CHKBUDGET()     if (budget>0 && --budget==0) SUSPEND()
+
+/* CHKINTERRUPT() is done on function entry and on every jump, so that no loop
+ * runs without passing it; the registers are saved as for a native call,
+ * the handler may walk the stack, suspend the call with AMX_ERR_SLEEP (it
+ * continues at the current instruction) or abort it with any other error
+ */
+#define CHKINTERRUPT()  if (amx_interrupt_pending && amx_interrupt_handler!=NULL) {\
+                          amx->cip=(cell)((unsigned char *)cip-code);\
+                          amx->hea=hea;\
+                          amx->frm=frm;\
+                          amx->stk=stk;\
+                          num=amx_interrupt_handler(amx);\
+                          if (num!=AMX_ERR_NONE) {\
+                            if (num==AMX_ERR_SLEEP)\
+                              SUSPEND();\
+                            ABORT(amx,num);\
+                          }\
+                        }
+
 #if (defined __GNUC__ && !defined __MINGW32__) && !(defined ASM32 || defined JIT)
     /* GNU C version uses the "labels as values" extension to create
      * fast "indirect threaded" interpreter.
      */
 
-#define NEXT(cip)       do { (amx)->cip=(cell)cip-(cell)code; goto **cip++; } while (0)
+#define NEXT(cip)       do { COUNT_INSTRUCTION(); (amx)->cip=(cell)cip-(cell)code; goto **cip++; } while (0)
 
 int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
 {
@@ -1759,6 +1919,7 @@ static const void * const amx_opcodelist[] = {
   cell offs;
   ucell codesize;
   int num,i;
+  long budget;
 
   /* HACK: return label table (for amx_BrowseRelocate) if amx structure
    * has the AMX_FLAG_BROWSE flag set.
@@ -1771,11 +1932,18 @@ static const void * const amx_opcodelist[] = {
     return 0;
   } /* if */
 
-  if (amx->callback==NULL)
+  /* the budget is for this call, not for the ones nested in it */
+  budget=amx_budget;
+  amx_budget=0;
+
+  /* amx_PrepareCall() has checked the callback and the relocation, but the
+   * natives may have been registered only after it
+   */
+  if (index!=AMX_EXEC_CALL && amx->callback==NULL)
     return AMX_ERR_CALLBACK;
   if ((amx->flags & AMX_FLAG_NTVREG)==0)
     return AMX_ERR_NOTFOUND;
-  if ((amx->flags & AMX_FLAG_RELOC)==0)
+  if (index!=AMX_EXEC_CALL && (amx->flags & AMX_FLAG_RELOC)==0)
     return AMX_ERR_INIT;
   assert((amx->flags & AMX_FLAG_BROWSE)==0);
 
@@ -1807,6 +1975,8 @@ static const void * const amx_opcodelist[] = {
     reset_stk=amx->reset_stk;
     reset_hea=amx->reset_hea;
     cip=(cell *)(code + (int)amx->cip);
+  } else if (index==AMX_EXEC_CALL) {
+    cip=(cell *)(code + (int)amx->cip);
   } else if (index<0) {
     return AMX_ERR_INDEX;
   } else {
@@ -2127,6 +2297,8 @@ static const void * const amx_opcodelist[] = {
     PUSH(frm);
     frm=stk;
     CHKMARGIN();
+    CHKINTERRUPT();
+    CHKBUDGET();
     NEXT(cip);
   op_ret:
     POP(frm);
@@ -2155,7 +2327,8 @@ static const void * const amx_opcodelist[] = {
   op_jump:
     /* since the GETPARAM() macro modifies cip, you cannot
      * do GETPARAM(cip) directly */
-    cip=JUMPABS(code, cip);
+    JUMPTO(JUMPABS(code, cip));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jrel:
     offs=*cip;
@@ -2163,75 +2336,87 @@ static const void * const amx_opcodelist[] = {
     NEXT(cip);
   op_jzer:
     if (pri==0)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jnz:
     if (pri!=0)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jeq:
     if (pri==alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jneq:
     if (pri!=alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jless:
     if ((ucell)pri < (ucell)alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jleq:
     if ((ucell)pri <= (ucell)alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jgrtr:
     if ((ucell)pri > (ucell)alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jgeq:
     if ((ucell)pri >= (ucell)alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jsless:
     if (pri<alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jsleq:
     if (pri<=alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jsgrtr:
     if (pri>alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_jsgeq:
     if (pri>=alt)
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
     else
       cip=(cell *)((unsigned char *)cip+sizeof(cell));
+    CHKINTERRUPT();
     NEXT(cip);
   op_shl:
     pri<<=alt;
@@ -2539,7 +2724,8 @@ static const void * const amx_opcodelist[] = {
         amx->alt=alt;
         amx->reset_stk=reset_stk;
         amx->reset_hea=reset_hea;
-        return num;
+        amx->error=AMX_ERR_NONE;  /* natives called directly do not reset it */
+        return AMX_ERR_SLEEP;
       } /* if */
       ABORT(amx,amx->error);
     } /* if */
@@ -2666,6 +2852,7 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
     OPCODE op;
     cell offs;
     int num;
+    long budget;
   #endif
   #if defined ASM32
     extern void const *amx_opcodelist[];
@@ -2702,11 +2889,20 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
     } /* if */
   #endif
 
-  if (amx->callback==NULL)
+  /* the budget is for this call, not for the ones nested in it */
+  #if !(defined ASM32 || defined JIT)
+    budget=amx_budget;
+  #endif
+  amx_budget=0;
+
+  /* amx_PrepareCall() has checked the callback and the relocation, but the
+   * natives may have been registered only after it
+   */
+  if (index!=AMX_EXEC_CALL && amx->callback==NULL)
     return AMX_ERR_CALLBACK;
   if ((amx->flags & AMX_FLAG_NTVREG)==0)
     return AMX_ERR_NOTFOUND;
-  if ((amx->flags & AMX_FLAG_RELOC)==0)
+  if (index!=AMX_EXEC_CALL && (amx->flags & AMX_FLAG_RELOC)==0)
     return AMX_ERR_INIT;
   assert((amx->flags & AMX_FLAG_BROWSE)==0);
 
@@ -2737,6 +2933,8 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
     reset_stk=amx->reset_stk;
     reset_hea=amx->reset_hea;
     cip=(cell *)(code + (int)amx->cip);
+  } else if (index==AMX_EXEC_CALL) {
+    cip=(cell *)(code + (int)amx->cip);
   } else if (index<0) {
     return AMX_ERR_INDEX;
   } else {
@@ -2822,6 +3020,7 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
 #else
 
   for ( ;; ) {
+    COUNT_INSTRUCTION();
     amx->cip=(cell)cip-(cell)code;
     op=(OPCODE) *cip++;
     switch (op) {
@@ -3107,6 +3306,8 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
       PUSH(frm);
       frm=stk;
       CHKMARGIN();
+      CHKINTERRUPT();
+      CHKBUDGET();
       break;
     case OP_RET:
       POP(frm);
@@ -3133,7 +3334,8 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
     case OP_JUMP:
       /* since the GETPARAM() macro modifies cip, you cannot
        * do GETPARAM(cip) directly */
-      cip=JUMPABS(code, cip);
+      JUMPTO(JUMPABS(code, cip));
+      CHKINTERRUPT();
       break;
     case OP_JREL:
       offs=*cip;
@@ -3141,75 +3343,87 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
       break;
     case OP_JZER:
       if (pri==0)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JNZ:
       if (pri!=0)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JEQ:
       if (pri==alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JNEQ:
       if (pri!=alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JLESS:
       if ((ucell)pri < (ucell)alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JLEQ:
       if ((ucell)pri <= (ucell)alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JGRTR:
       if ((ucell)pri > (ucell)alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JGEQ:
       if ((ucell)pri >= (ucell)alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JSLESS:
       if (pri<alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JSLEQ:
       if (pri<=alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JSGRTR:
       if (pri>alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_JSGEQ:
       if (pri>=alt)
-        cip=JUMPABS(code, cip);
+        JUMPTO(JUMPABS(code, cip));
       else
         cip=(cell *)((unsigned char *)cip+sizeof(cell));
+      CHKINTERRUPT();
       break;
     case OP_SHL:
       pri<<=alt;
@@ -3517,7 +3731,8 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
           amx->alt=alt;
           amx->reset_stk=reset_stk;
           amx->reset_hea=reset_hea;
-          return num;
+          amx->error=AMX_ERR_NONE;  /* natives called directly do not reset it */
+          return AMX_ERR_SLEEP;
         } /* if */
         ABORT(amx,amx->error);
       } /* if */
@@ -3602,6 +3817,45 @@ int AMXAPI amx_Exec(AMX *amx, cell *retval, int index)
 
 #endif /* AMX_EXEC || AMX_INIT */
 
+#if defined AMX_COUNT_INSTRUCTIONS
+/* amx_InstructionCount() returns the number of instructions that amx_Exec()
+ * has executed on the calling thread so far. The count is only kept when
+ * the AMX is built with AMX_COUNT_INSTRUCTIONS.
+ */
+uint64_t AMXAPI amx_InstructionCount(void)
+{
+  return amx_instructions;
+}
+#endif /* AMX_COUNT_INSTRUCTIONS */
+
+/* amx_SetInterrupt() installs the function that amx_Exec() calls, on the
+ * thread running the script, while an interrupt is pending; NULL removes it.
+ * amx_Interrupt() raises or clears the pending flag and may be called from
+ * any thread; it is up to the handler (or the caller) to clear it again.
+ */
+int AMXAPI amx_SetInterrupt(AMX_INTERRUPT handler)
+{
+  amx_interrupt_handler=handler;
+  return AMX_ERR_NONE;
+}
+
+void AMXAPI amx_Interrupt(int pending)
+{
+  amx_interrupt_pending=pending;
+}
+
+/* amx_SetBudget() limits the next amx_Exec() on the calling thread to about
+ * "instructions" instructions, counted on backward jumps and function calls;
+ * when they are used up, amx_Exec() returns AMX_ERR_SLEEP and the call can be
+ * continued with AMX_EXEC_CONT, with a new budget. Calls nested in that one
+ * (from natives) have no budget. A budget of 0 means no limit.
+ */
+int AMXAPI amx_SetBudget(long instructions)
+{
+  amx_budget=instructions;
+  return AMX_ERR_NONE;
+}
+
 #if defined AMX_SETCALLBACK
 int AMXAPI amx_SetCallback(AMX *amx,AMX_CALLBACK callback)
 {
@@ -3683,6 +3937,213 @@ int AMXAPI amx_Release(AMX *amx,cell amx_addr)
 }
 #endif /* AMX_ALLOT */
 
+#if defined AMX_SSE2 && (defined AMX_XXXSTRING || defined AMX_UTF8XXX || defined AMX_EXEC)
+
+/* reverse the bytes in each of the four cells (swapcell() on a vector) */
+static __m128i sse2_swapcells(__m128i v)
+{
+  v=_mm_shufflelo_epi16(v,_MM_SHUFFLE(2,3,0,1));
+  v=_mm_shufflehi_epi16(v,_MM_SHUFFLE(2,3,0,1));
+  return _mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+}
+
+/* index of the first cell that is set in a _mm_movemask_epi8() result */
+static int sse2_firstcell(int mask)
+{
+  assert(mask!=0);
+  if ((mask & 0x000f)!=0)
+    return 0;
+  if ((mask & 0x00f0)!=0)
+    return 1;
+  if ((mask & 0x0f00)!=0)
+    return 2;
+  return 3;
+}
+
+/* Return the index of the first zero cell in "cstr", or "max" if none of the
+ * first "max" cells is zero. After a short scalar prologue all loads are
+ * aligned, so they may read beyond the terminator but never into the next
+ * memory page.
+ */
+static size_t sse2_unpackedlen(const cell *cstr, size_t max)
+{
+  const __m128i zero=_mm_setzero_si128();
+  size_t len=0;
+  int mask;
+
+  while (len<max && ((size_t)(cstr+len) & 15)!=0) {
+    if (cstr[len]==0)
+      return len;
+    len++;
+  } /* while */
+  while (len<max) {
+    mask=_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_load_si128((const __m128i *)(cstr+len)),zero));
+    if (mask!=0) {
+      len+=sse2_firstcell(mask);
+      return (len<max) ? len : max;
+    } /* if */
+    len+=4;
+  } /* while */
+  return max;
+}
+
+/* Return the number of characters in the packed string "cstr" before the
+ * terminating zero, or "max" if none of the first "max" characters is zero.
+ * A cell that holds a zero byte holds the terminator; the loads are aligned
+ * as in sse2_unpackedlen().
+ */
+static size_t sse2_packedlen(const cell *cstr, size_t max)
+{
+  const __m128i zero=_mm_setzero_si128();
+  size_t cells=(max+sizeof(cell)-1)/sizeof(cell);
+  size_t i=0,len;
+  int mask;
+
+  while (i<cells && ((size_t)(cstr+i) & 15)!=0) {
+    if ((((ucell)cstr[i]-0x01010101u) & ~(ucell)cstr[i] & 0x80808080u)!=0)
+      break;
+    i++;
+  } /* while */
+  if (i<cells && ((size_t)(cstr+i) & 15)==0) {
+    while (i<cells) {
+      mask=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)(cstr+i)),zero));
+      if (mask!=0) {
+        i+=sse2_firstcell(mask);
+        break;
+      } /* if */
+      i+=4;
+    } /* while */
+  } /* if */
+  /* find the zero character in cell "i", in string order */
+  for (len=i*sizeof(cell); len<max; len++)
+    if ((char)(cstr[i] >> (sizeof(cell)-1-len%sizeof(cell))*8)==0)
+      return len;
+  return max;
+}
+
+/* store the low byte of each of "count" cells in "dest" */
+static void sse2_narrow(char *dest, const cell *source, size_t count)
+{
+  const __m128i lowbyte=_mm_set1_epi32(0xff);
+  __m128i a,b,c,d;
+  size_t i;
+
+  for (i=0; i+16<=count; i+=16) {
+    a=_mm_and_si128(_mm_loadu_si128((const __m128i *)(source+i)),lowbyte);
+    b=_mm_and_si128(_mm_loadu_si128((const __m128i *)(source+i+4)),lowbyte);
+    c=_mm_and_si128(_mm_loadu_si128((const __m128i *)(source+i+8)),lowbyte);
+    d=_mm_and_si128(_mm_loadu_si128((const __m128i *)(source+i+12)),lowbyte);
+    /* all values are in 0..255, so the saturating packs are exact */
+    a=_mm_packus_epi16(_mm_packs_epi32(a,b),_mm_packs_epi32(c,d));
+    _mm_storeu_si128((__m128i *)(dest+i),a);
+  } /* for */
+  for ( ; i<count; i++)
+    dest[i]=(char)source[i];
+}
+
+/* widen "count" characters to cells, with the same sign extension as a plain
+ * (cell)source[i] cast
+ */
+static void sse2_widen(cell *dest, const char *source, size_t count)
+{
+  __m128i v,lo,hi;
+  size_t i;
+
+  for (i=0; i+16<=count; i+=16) {
+    v=_mm_loadu_si128((const __m128i *)(source+i));
+    #if CHAR_MIN<0
+      lo=_mm_srai_epi16(_mm_unpacklo_epi8(v,v),8);
+      hi=_mm_srai_epi16(_mm_unpackhi_epi8(v,v),8);
+      _mm_storeu_si128((__m128i *)(dest+i),_mm_srai_epi32(_mm_unpacklo_epi16(lo,lo),16));
+      _mm_storeu_si128((__m128i *)(dest+i+4),_mm_srai_epi32(_mm_unpackhi_epi16(lo,lo),16));
+      _mm_storeu_si128((__m128i *)(dest+i+8),_mm_srai_epi32(_mm_unpacklo_epi16(hi,hi),16));
+      _mm_storeu_si128((__m128i *)(dest+i+12),_mm_srai_epi32(_mm_unpackhi_epi16(hi,hi),16));
+    #else
+      lo=_mm_unpacklo_epi8(v,_mm_setzero_si128());
+      hi=_mm_unpackhi_epi8(v,_mm_setzero_si128());
+      _mm_storeu_si128((__m128i *)(dest+i),_mm_unpacklo_epi16(lo,_mm_setzero_si128()));
+      _mm_storeu_si128((__m128i *)(dest+i+4),_mm_unpackhi_epi16(lo,_mm_setzero_si128()));
+      _mm_storeu_si128((__m128i *)(dest+i+8),_mm_unpacklo_epi16(hi,_mm_setzero_si128()));
+      _mm_storeu_si128((__m128i *)(dest+i+12),_mm_unpackhi_epi16(hi,_mm_setzero_si128()));
+    #endif
+  } /* for */
+  for ( ; i<count; i++)
+    dest[i]=(cell)source[i];
+}
+
+/* swap the bytes of "count" cells in place */
+static void sse2_swapcellblock(cell *cells, size_t count)
+{
+  size_t i;
+
+  for (i=0; i+4<=count; i+=4)
+    _mm_storeu_si128((__m128i *)(cells+i),sse2_swapcells(_mm_loadu_si128((const __m128i *)(cells+i))));
+  for ( ; i<count; i++)
+    swapcell((ucell *)&cells[i]);
+}
+
+/* copy "count" characters of a packed string to "dest", in string order */
+static void sse2_unpackchars(char *dest, const cell *source, size_t count)
+{
+  size_t i;
+  cell c;
+
+  for (i=0; i+16<=count; i+=16)
+    _mm_storeu_si128((__m128i *)(dest+i),sse2_swapcells(_mm_loadu_si128((const __m128i *)(source+i/sizeof(cell)))));
+  for ( ; i<count; i++) {
+    c=source[i/sizeof(cell)];
+    dest[i]=(char)(c >> (sizeof(cell)-1-i%sizeof(cell))*8*sizeof(char));
+  } /* for */
+}
+
+/* Return the number of leading characters in "string" that are 7-bit ASCII
+ * (but not the terminating zero). Like sse2_unpackedlen(), the loads are
+ * aligned so that they never cross into the next memory page.
+ */
+static size_t sse2_asciirun(const char *string)
+{
+  const unsigned char *s=(const unsigned char *)string;
+  size_t len=0;
+  int mask;
+  __m128i v;
+
+  while (((size_t)(s+len) & 15)!=0) {
+    if (s[len]==0 || s[len]>=0x80)
+      return len;
+    len++;
+  } /* while */
+  for ( ;; ) {
+    v=_mm_load_si128((const __m128i *)(s+len));
+    mask=_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_setzero_si128()));
+    if (mask!=0)
+      break;
+    len+=16;
+  } /* for */
+  while ((mask & 1)==0) {
+    mask>>=1;
+    len++;
+  } /* while */
+  return len;
+}
+
+/* Return the number of leading cells among the first "count" that encode to
+ * a single byte in UTF-8 (values below 0x80).
+ */
+static size_t sse2_asciicells(const cell *cstr, size_t count)
+{
+  const __m128i limit=_mm_set1_epi32(0x80);
+  size_t i;
+
+  for (i=0; i+4<=count; i+=4)
+    if (_mm_movemask_epi8(_mm_cmplt_epi32(_mm_loadu_si128((const __m128i *)(cstr+i)),limit))!=0xffff)
+      break;
+  while (i<count && cstr[i]<0x80)
+    i++;
+  return i;
+}
+
+#endif /* AMX_SSE2 */
+
 #if defined AMX_XXXSTRING || defined AMX_UTF8XXX
 
 #define CHARBITS        (8*sizeof(char))
@@ -3724,8 +4185,12 @@ int AMXAPI amx_StrLen(const cell *cstr, int *length)
       } /* if */
     #endif
   } else {
-    for (len=0; cstr[len]!=0; len++)
-      /* nothing */;
+    #if defined AMX_SSE2
+      len=(int)sse2_unpackedlen(cstr,UNLIMITED);
+    #else
+      for (len=0; cstr[len]!=0; len++)
+        /* nothing */;
+    #endif
   } /* if */
   *length = len;
   return AMX_ERR_NONE;
@@ -3763,7 +4228,9 @@ int AMXAPI amx_SetString(cell *dest,const char *source,int pack,int use_wchar,si
      * cells; on Little Endian machines, we must swap all cells.
      */
     assert(check_endian());
-    #if BYTE_ORDER==LITTLE_ENDIAN
+    #if defined AMX_SSE2
+      sse2_swapcellblock(dest,len/sizeof(cell)+1);
+    #elif BYTE_ORDER==LITTLE_ENDIAN
       len /= sizeof(cell);
       while (len>=0)
         swapcell((ucell *)&dest[len--]);
@@ -3781,8 +4248,12 @@ int AMXAPI amx_SetString(cell *dest,const char *source,int pack,int use_wchar,si
         for (i=0; i<len; i++)
           dest[i]=(cell)(((wchar_t*)source)[i]);
       } else {
-        for (i=0; i<len; i++)
-          dest[i]=(cell)source[i];
+        #if defined AMX_SSE2
+          sse2_widen(dest,source,len);
+        #else
+          for (i=0; i<len; i++)
+            dest[i]=(cell)source[i];
+        #endif
       } /* if */
     #endif
     dest[len]=0;
@@ -3802,6 +4273,16 @@ int AMXAPI amx_GetString(char *dest,const cell *source,int use_wchar,size_t size
     /* source string is packed */
     cell c = 0;         /* to avoid a compiler warning */
     int i=sizeof(cell)-1;
+    #if defined AMX_SSE2
+      if (!use_wchar) {
+        /* copy the characters up to and including the terminator at once,
+         * without looking beyond "size" characters for it
+         */
+        len=(int)sse2_packedlen(source,size);
+        len=((size_t)len<size) ? len+1 : (int)size;
+        sse2_unpackchars(dest,source,len);
+      } else
+    #endif
     while ((size_t)len<size) {
       if (i==sizeof(cell)-1)
         c=*source++;
@@ -3827,8 +4308,13 @@ int AMXAPI amx_GetString(char *dest,const cell *source,int use_wchar,size_t size
         while (*source!=0 && (size_t)len<size)
           ((wchar_t*)dest)[len++]=(wchar_t)*source++;
       } else {
-        while (*source!=0 && (size_t)len<size)
-          dest[len++]=(char)*source++;
+        #if defined AMX_SSE2
+          len=(int)sse2_unpackedlen(source,size);
+          sse2_narrow(dest,source,len);
+        #else
+          while (*source!=0 && (size_t)len<size)
+            dest[len++]=(char)*source++;
+        #endif
       } /* if */
     #endif
   } /* if */
@@ -4000,7 +4486,18 @@ int AMXAPI amx_UTF8Check(const char *string, int *length)
 {
   int err=AMX_ERR_NONE;
   int len=0;
+  #if defined AMX_SSE2
+    size_t run;
+  #endif
   while (err==AMX_ERR_NONE && *string!='\0') {
+    #if defined AMX_SSE2
+      /* skip over plain ASCII in bulk, decode only the multi-byte codes */
+      run=sse2_asciirun(string);
+      string+=run;
+      len+=(int)run;
+      if (*string=='\0')
+        break;
+    #endif
     err=amx_UTF8Get(string,&string,NULL);
     len++;
   } /* while */
@@ -4024,7 +4521,19 @@ int AMXAPI amx_UTF8Len(const cell *cstr, int *length)
     char buffer[10];  /* maximum UTF-8 code is 6 characters */
     char *endptr;
     int len=*length, count=0;
+    #if defined AMX_SSE2
+      int run;
+    #endif
     while (len-->0) {
+      #if defined AMX_SSE2
+        /* every cell below 0x80 takes a single byte */
+        run=(int)sse2_asciicells(cstr,len+1);
+        cstr+=run;
+        count+=run;
+        len-=run;
+        if (len<0)
+          break;
+      #endif
       amx_UTF8Put(buffer, &endptr, sizeof buffer, *cstr++);
       count+=(int)(endptr-buffer);
     } /* while */
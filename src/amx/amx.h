@@ -168,6 +168,7 @@ typedef int (AMXAPI *AMX_CALLBACK)(struct tagAMX *amx, cell index,
                                    cell *result, cell *params);
 typedef int (AMXAPI *AMX_DEBUG)(struct tagAMX *amx);
 typedef void (AMXAPI *AMX_EXEC_ERROR)(struct tagAMX *amx, int index, cell *retval, int error);
+typedef int (AMXAPI *AMX_INTERRUPT)(struct tagAMX *amx);
 #if !defined _FAR
   #define _FAR
 #endif
@@ -224,6 +225,13 @@ typedef struct tagFUNCSTUBNT {
   uint32_t nameofs      PACKED;
 } PACKED AMX_FUNCSTUBNT;
 
+/* A public function prepared for repeated calls, see amx_PrepareCall() */
+typedef struct tagAMX_CALL {
+  struct tagAMX _FAR *amx;
+  int index;
+  ucell address;        /* code address of the function */
+} AMX_CALL;
+
 /* The AMX structure is the internal structure for many functions. Not all
  * fields are valid at all times; many fields are cached in local variables.
  */
@@ -376,6 +384,7 @@ int AMXAPI amx_Callback(AMX *amx, cell index, cell *result, cell *params);
 int AMXAPI amx_Cleanup(AMX *amx);
 int AMXAPI amx_Clone(AMX *amxClone, AMX *amxSource, void *data);
 int AMXAPI amx_Exec(AMX *amx, cell *retval, int index);
+int AMXAPI amx_ExecCall(const AMX_CALL *call, cell *retval, const cell args[], int numargs);
 int AMXAPI amx_FindNative(AMX *amx, const char *name, int *index);
 int AMXAPI amx_FindPublic(AMX *amx, const char *funcname, int *index);
 int AMXAPI amx_FindPubVar(AMX *amx, const char *varname, cell *amx_addr);
@@ -391,6 +400,10 @@ int AMXAPI amx_GetTag(AMX *amx, int index, char *tagname, cell *tag_id);
 int AMXAPI amx_GetUserData(AMX *amx, long tag, void **ptr);
 int AMXAPI amx_Init(AMX *amx, void *program);
 int AMXAPI amx_InitJIT(AMX *amx, void *reloc_table, void *native_code);
+#if defined AMX_COUNT_INSTRUCTIONS
+uint64_t AMXAPI amx_InstructionCount(void);
+#endif
+void AMXAPI amx_Interrupt(int pending);
 int AMXAPI amx_MemInfo(AMX *amx, long *codesize, long *datasize, long *stackheap);
 int AMXAPI amx_NameLength(AMX *amx, int *length);
 AMX_NATIVE_INFO * AMXAPI amx_NativeInfo(const char *name, AMX_NATIVE func);
@@ -398,16 +411,20 @@ int AMXAPI amx_NumNatives(AMX *amx, int *number);
 int AMXAPI amx_NumPublics(AMX *amx, int *number);
 int AMXAPI amx_NumPubVars(AMX *amx, int *number);
 int AMXAPI amx_NumTags(AMX *amx, int *number);
+int AMXAPI amx_PrepareCall(AMX *amx, const char *funcname, AMX_CALL *call);
 int AMXAPI amx_Push(AMX *amx, cell value);
+int AMXAPI amx_PushArgs(AMX *amx, const cell args[], int numargs);
 int AMXAPI amx_PushArray(AMX *amx, cell *amx_addr, cell **phys_addr, const cell array[], int numcells);
 int AMXAPI amx_PushString(AMX *amx, cell *amx_addr, cell **phys_addr, const char *string, int pack, int use_wchar);
 int AMXAPI amx_RaiseError(AMX *amx, int error);
 int AMXAPI amx_RaiseExecError(AMX *amx, cell index, cell *retval, int error);
 int AMXAPI amx_Register(AMX *amx, const AMX_NATIVE_INFO *nativelist, int number);
 int AMXAPI amx_Release(AMX *amx, cell amx_addr);
+int AMXAPI amx_SetBudget(long instructions);
 int AMXAPI amx_SetCallback(AMX *amx, AMX_CALLBACK callback);
 int AMXAPI amx_SetDebugHook(AMX *amx, AMX_DEBUG debug);
 int AMXAPI amx_SetExecErrorHandler(AMX *amx, AMX_EXEC_ERROR handler);
+int AMXAPI amx_SetInterrupt(AMX_INTERRUPT handler);
 int AMXAPI amx_SetString(cell *dest, const char *source, int pack, int use_wchar, size_t size);
 int AMXAPI amx_SetUserData(AMX *amx, long tag, void *ptr);
 int AMXAPI amx_StrLen(const cell *cstring, int *length);
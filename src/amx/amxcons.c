@@ -404,6 +404,20 @@ static int cons_putchar(void *dest,TCHAR ch)
   return amx_putchar(ch);
 }
 
+/* By default print() and printf() flush the console after every line, which
+ * is what an interactive user wants to see. A host that writes to a pipe or
+ * a file can switch to full buffering with amx_ConsoleBuffer(); the output is
+ * then only written when the buffer fills up, when the host calls
+ * amx_ConsoleFlush() or when the program exits.
+ */
+#if !defined AMXCONSOLE_BUFSIZE
+  #define AMXCONSOLE_BUFSIZE  65536
+#endif
+static int cons_lineflush=1;
+static char cons_buffer[AMXCONSOLE_BUFSIZE];
+
+#define cons_endline()  do { if (cons_lineflush) amx_fflush(); } while (0)
+
 #endif /* AMX_STRING_LIB */
 
 enum {
@@ -917,7 +931,7 @@ static cell AMX_NATIVE_CALL n_print(AMX *amx,const cell *params)
   amx_GetAddr(amx,params[1],&cstr);
   amx_printstring(amx,cstr,&info);
   amx_putchar('\n');
-  amx_fflush();
+  cons_endline();
   return 0;
 }
 #else
@@ -938,7 +952,7 @@ static cell AMX_NATIVE_CALL n_print(AMX *amx,const cell *params)
   /* reset the colours */
   (void)amx_setattr(oldcolours & 0xff,(oldcolours >> 8) & 0x7f,(oldcolours >> 15) & 0x01);
   amx_putchar('\n');
-  amx_fflush();
+  cons_endline();
   return 0;
 }
 #endif
@@ -958,7 +972,7 @@ static cell AMX_NATIVE_CALL n_printf(AMX *amx,const cell *params)
   amx_GetAddr(amx,params[1],&cstr);
   amx_printstring(amx,cstr,&info);
   amx_putchar('\n');
-  amx_fflush();
+  cons_endline();
   return 0;
 }
 
@@ -1257,6 +1271,23 @@ int AMXEXPORT amx_ConsoleInit(AMX *amx)
   return amx_Register(amx, console_Natives, -1);
 }
 
+/* amx_ConsoleBuffer() must be called before anything is written to the
+ * console; a non-zero "lineflush" keeps the line-by-line behaviour.
+ */
+int AMXEXPORT amx_ConsoleBuffer(int lineflush)
+{
+  cons_lineflush=lineflush;
+  if (lineflush)
+    return setvbuf(stdout,NULL,_IOLBF,BUFSIZ)==0 ? AMX_ERR_NONE : AMX_ERR_GENERAL;
+  return setvbuf(stdout,cons_buffer,_IOFBF,sizeof cons_buffer)==0 ? AMX_ERR_NONE : AMX_ERR_GENERAL;
+}
+
+int AMXEXPORT amx_ConsoleFlush(void)
+{
+  amx_fflush();
+  return AMX_ERR_NONE;
+}
+
 int AMXEXPORT amx_ConsoleCleanup(AMX *amx)
 {
   (void)amx;
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 #if defined __WIN32__ || defined _WIN32 || defined WIN32 || defined __MSDOS__
   #include <io.h>
@@ -46,7 +47,11 @@
 #endif
 #if defined LINUX || defined __FreeBSD__ || defined __OpenBSD__ || defined MACOS
   #include <dirent.h>
+  #include <fcntl.h>
   #include <unistd.h>
+  #include <pthread.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
 #endif
 #include "osdefs.h"
 #include "amx.h"
@@ -67,6 +72,7 @@
 # define _tfputs        fputs
 # define _tcscat        strcat
 # define _tcschr        strchr
+# define _tcscmp        strcmp
 # define _tcscpy        strcpy
 # define _tcsdup        strdup
 # define _tcslen        strlen
@@ -93,16 +99,23 @@ enum seek_whence {
 };
 
 
+#if !defined AMXFILE_BLOCKSIZE
+  #define AMXFILE_BLOCKSIZE 512 /* bytes read/written per stdio call for text lines */
+#endif
+
 /* This function only stores unpacked strings. UTF-8 is used for
  * Unicode, and packed strings can only store 7-bit and 8-bit
  * character sets (ASCII, Latin-1).
+ * The file is read a block at a time; the bytes behind the end of the line
+ * are given back with fseek() (files are always opened in binary mode).
  */
 static size_t fgets_cell(FILE *fp,cell *string,size_t max,int utf8mode)
 {
-  size_t index;
+  unsigned char block[AMXFILE_BLOCKSIZE];
+  size_t index,count,i;
   fpos_t pos;
-  cell c;
-  int follow,lastcr;
+  cell c,value;
+  int follow,lastcr,done;
   cell lowmark;
 
   assert(sizeof(cell)>=4);
@@ -114,166 +127,190 @@ static size_t fgets_cell(FILE *fp,cell *string,size_t max,int utf8mode)
   /* get the position, in case we have to back up */
   fgetpos(fp, &pos);
 
+restart:
   index=0;
   follow=0;
   lowmark=0;
+  value=0;
   lastcr=0;
-  for ( ;; ) {
-    assert(index<max);
-    if (index==max-1)
-      break;                    /* string fully filled */
-    if ((c=fgetc(fp))==EOF) {
-      if (!utf8mode || follow==0)
-        break;                  /* no more characters */
-      /* If an EOF happened halfway an UTF-8 code, the string cannot be
-       * UTF-8 mode, and we must restart.
-       */
-      index=0;
-      fsetpos(fp, &pos);
-      continue;
+  done=0;
+  while (!done && index<max-1) {
+    if ((count=fread(block,1,sizeof block,fp))==0) {
+      if (utf8mode && follow>0) {
+        /* If an EOF happened halfway an UTF-8 code, the string cannot be
+         * UTF-8 mode, and we must restart.
+         */
+        utf8mode=0;
+        fsetpos(fp, &pos);
+        goto restart;
+      } /* if */
+      break;                    /* no more characters */
     } /* if */
 
-    /* 8-bit characters are unsigned */
-    if (c<0)
-      c=-c;
-
-    if (utf8mode) {
-      if (follow>0 && (c & 0xc0)==0x80) {
+    for (i=0; i<count && !done && index<max-1; ) {
+      c=block[i];               /* 8-bit characters are unsigned */
+      if (!utf8mode) {
+        if (lastcr && c!=__T('\n')) {
+          done=1;               /* carriage return was read, no newline follows */
+          break;
+        } /* if */
+        string[index++]=c;
+        i++;
+        done=(c==__T('\n'));    /* read newline, done */
+        lastcr=(c==__T('\r'));
+      } else if (follow>0) {
+        if ((c & 0xc0)!=0x80)
+          goto invalid;
         /* leader code is active, combine with earlier code */
-        string[index]=(string[index] << 6) | ((unsigned char)c & 0x3f);
+        value=(value << 6) | (c & 0x3f);
+        i++;
         if (--follow==0) {
           /* encoding a character in more bytes than is strictly needed,
            * is not really valid UTF-8; we are strict here to increase
            * the chance of heuristic dectection of non-UTF-8 text
            * (JAVA writes zero bytes as a 2-byte code UTF-8, which is invalid)
            */
-          if (string[index]<lowmark)
-            utf8mode=0;
+          if (value<lowmark)
+            goto invalid;
           /* the code positions 0xd800--0xdfff and 0xfffe & 0xffff do not
            * exist in UCS-4 (and hence, they do not exist in Unicode)
            */
-          if (string[index]>=0xd800 && string[index]<=0xdfff
-              || string[index]==0xfffe || string[index]==0xffff)
-            utf8mode=0;
-          index++;
+          if (value>=0xd800 && value<=0xdfff || value==0xfffe || value==0xffff)
+            goto invalid;
+          string[index++]=value;
         } /* if */
-      } else if (follow==0 && (c & 0x80)==0x80) {
+      } else if ((c & 0x80)==0x00) {
+        /* 0xxxxxxx (US-ASCII), copy the whole run up to the newline */
+        do {
+          string[index++]=c;
+          i++;
+          if (c==__T('\n')) {
+            done=1;             /* read newline, done */
+            break;
+          } /* if */
+        } while (i<count && index<max-1 && ((c=block[i]) & 0x80)==0x00);
+      } else {
         /* UTF-8 leader code */
         if ((c & 0xe0)==0xc0) {
           /* 110xxxxx 10xxxxxx */
           follow=1;
           lowmark=0x80;
-          string[index]=c & 0x1f;
+          value=c & 0x1f;
         } else if ((c & 0xf0)==0xe0) {
           /* 1110xxxx 10xxxxxx 10xxxxxx (16 bits, BMP plane) */
           follow=2;
           lowmark=0x800;
-          string[index]=c & 0x0f;
+          value=c & 0x0f;
         } else if ((c & 0xf8)==0xf0) {
           /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
           follow=3;
           lowmark=0x10000;
-          string[index]=c & 0x07;
+          value=c & 0x07;
         } else if ((c & 0xfc)==0xf8) {
           /* 111110xx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx */
           follow=4;
           lowmark=0x200000;
-          string[index]=c & 0x03;
+          value=c & 0x03;
         } else if ((c & 0xfe)==0xfc) {
           /* 1111110x 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx (31 bits) */
           follow=5;
           lowmark=0x4000000;
-          string[index]=c & 0x01;
+          value=c & 0x01;
         } else {
-          /* this is invalid UTF-8 */
-          utf8mode=0;
+          goto invalid;
         } /* if */
-      } else if (follow==0 && (c & 0x80)==0x00) {
-        /* 0xxxxxxx (US-ASCII) */
-        string[index++]=c;
-        if (c==__T('\n'))
-          break;        /* read newline, done */
-      } else {
-        /* this is invalid UTF-8 */
-        utf8mode=0;
-      } /* if */
-      if (!utf8mode) {
-        /* UTF-8 mode was switched just off, which means that non-conforming
-         * UTF-8 codes were found, which means in turn that the string is
-         * probably not intended as UTF-8; start over again
-         */
-        index=0;
-        fsetpos(fp, &pos);
-      } /* if */
-    } else {
-      string[index++]=c;
-      if (c==__T('\n')) {
-        break;                  /* read newline, done */
-      } else if (lastcr) {
-        ungetc(c,fp);           /* carriage return was read, no newline follows */
-        break;
+        i++;
       } /* if */
-      lastcr=(c==__T('\r'));
-    } /* if */
-  } /* for */
+    } /* for */
+
+    /* give back what was read beyond the end of the line */
+    if (i<count)
+      fseek(fp,-(long)(count-i),SEEK_CUR);
+  } /* while */
   assert(index<max);
   string[index]=__T('\0');
 
   return index;
+
+invalid:
+  /* Non-conforming UTF-8 codes were found, which means in turn that the
+   * string is probably not intended as UTF-8; start over again.
+   */
+  utf8mode=0;
+  fsetpos(fp, &pos);
+  goto restart;
 }
 
+/* UTF-8 encode one character into "dest", return the number of bytes */
+static size_t pututf8(unsigned char *dest,cell c)
+{
+  if (c<0x80) {
+    /* 0xxxxxxx */
+    dest[0]=(unsigned char)c;
+    return 1;
+  } else if (c<0x800) {
+    /* 110xxxxx 10xxxxxx */
+    dest[0]=(unsigned char)((c>>6) & 0x1f | 0xc0);
+    dest[1]=(unsigned char)(c & 0x3f | 0x80);
+    return 2;
+  } else if (c<0x10000) {
+    /* 1110xxxx 10xxxxxx 10xxxxxx (16 bits, BMP plane) */
+    dest[0]=(unsigned char)((c>>12) & 0x0f | 0xe0);
+    dest[1]=(unsigned char)((c>>6) & 0x3f | 0x80);
+    dest[2]=(unsigned char)(c & 0x3f | 0x80);
+    return 3;
+  } else if (c<0x200000) {
+    /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
+    dest[0]=(unsigned char)((c>>18) & 0x07 | 0xf0);
+    dest[1]=(unsigned char)((c>>12) & 0x3f | 0x80);
+    dest[2]=(unsigned char)((c>>6) & 0x3f | 0x80);
+    dest[3]=(unsigned char)(c & 0x3f | 0x80);
+    return 4;
+  } else if (c<0x4000000) {
+    /* 111110xx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx */
+    dest[0]=(unsigned char)((c>>24) & 0x03 | 0xf8);
+    dest[1]=(unsigned char)((c>>18) & 0x3f | 0x80);
+    dest[2]=(unsigned char)((c>>12) & 0x3f | 0x80);
+    dest[3]=(unsigned char)((c>>6) & 0x3f | 0x80);
+    dest[4]=(unsigned char)(c & 0x3f | 0x80);
+    return 5;
+  } /* if */
+  /* 1111110x 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx (31 bits) */
+  dest[0]=(unsigned char)((c>>30) & 0x01 | 0xfc);
+  dest[1]=(unsigned char)((c>>24) & 0x3f | 0x80);
+  dest[2]=(unsigned char)((c>>18) & 0x3f | 0x80);
+  dest[3]=(unsigned char)((c>>12) & 0x3f | 0x80);
+  dest[4]=(unsigned char)((c>>6) & 0x3f | 0x80);
+  dest[5]=(unsigned char)(c & 0x3f | 0x80);
+  return 6;
+}
+
+/* The string is encoded into a local block, which is written with a single
+ * fwrite() each time it fills up.
+ */
 static size_t fputs_cell(FILE *fp,cell *string,int utf8mode)
 {
-  size_t count=0;
+  unsigned char block[AMXFILE_BLOCKSIZE];
+  size_t count=0,used=0;
 
   assert(sizeof(cell)>=4);
   assert(fp!=NULL);
   assert(string!=NULL);
 
   while (*string!=0) {
-    if (utf8mode) {
-      cell c=*string;
-      if (c<0x80) {
-        /* 0xxxxxxx */
-        fputc((unsigned char)c,fp);
-      } else if (c<0x800) {
-        /* 110xxxxx 10xxxxxx */
-        fputc((unsigned char)((c>>6) & 0x1f | 0xc0),fp);
-        fputc((unsigned char)(c & 0x3f | 0x80),fp);
-      } else if (c<0x10000) {
-        /* 1110xxxx 10xxxxxx 10xxxxxx (16 bits, BMP plane) */
-        fputc((unsigned char)((c>>12) & 0x0f | 0xe0),fp);
-        fputc((unsigned char)((c>>6) & 0x3f | 0x80),fp);
-        fputc((unsigned char)(c & 0x3f | 0x80),fp);
-      } else if (c<0x200000) {
-        /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
-        fputc((unsigned char)((c>>18) & 0x07 | 0xf0),fp);
-        fputc((unsigned char)((c>>12) & 0x3f | 0x80),fp);
-        fputc((unsigned char)((c>>6) & 0x3f | 0x80),fp);
-        fputc((unsigned char)(c & 0x3f | 0x80),fp);
-      } else if (c<0x4000000) {
-        /* 111110xx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx */
-        fputc((unsigned char)((c>>24) & 0x03 | 0xf8),fp);
-        fputc((unsigned char)((c>>18) & 0x3f | 0x80),fp);
-        fputc((unsigned char)((c>>12) & 0x3f | 0x80),fp);
-        fputc((unsigned char)((c>>6) & 0x3f | 0x80),fp);
-        fputc((unsigned char)(c & 0x3f | 0x80),fp);
-      } else {
-        /* 1111110x 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx 10xxxxxx (31 bits) */
-        fputc((unsigned char)((c>>30) & 0x01 | 0xfc),fp);
-        fputc((unsigned char)((c>>24) & 0x3f | 0x80),fp);
-        fputc((unsigned char)((c>>18) & 0x3f | 0x80),fp);
-        fputc((unsigned char)((c>>12) & 0x3f | 0x80),fp);
-        fputc((unsigned char)((c>>6) & 0x3f | 0x80),fp);
-        fputc((unsigned char)(c & 0x3f | 0x80),fp);
-      } /* if */
-    } else {
-      /* not UTF-8 mode */
-      fputc((unsigned char)*string,fp);
+    if (used+6>sizeof block) {
+      fwrite(block,1,used,fp);
+      used=0;
     } /* if */
+    if (utf8mode)
+      used+=pututf8(block+used,*string);
+    else
+      block[used++]=(unsigned char)*string; /* not UTF-8 mode */
     string++;
     count++;
   } /* while */
+  if (used>0)
+    fwrite(block,1,used,fp);
   return count;
 }
 
@@ -403,6 +440,14 @@ static char *completename(TCHAR *dest, TCHAR *src, size_t size)
   #endif
 }
 
+/* Complete a file name in the same way as fopen() does, for hosts that open
+ * files on behalf of a script. Returns NULL if the name is not allowed.
+ */
+char * AMXEXPORT amx_FileCompleteName(TCHAR *dest, const TCHAR *name, size_t size)
+{
+  return completename(dest,(TCHAR*)name,size);
+}
+
 /* File: fopen(const name[], filemode: mode) */
 static cell AMX_NATIVE_CALL n_fopen(AMX *amx, const cell *params)
 {
@@ -554,21 +599,32 @@ static cell AMX_NATIVE_CALL n_fgetchar(AMX *amx, const cell *params)
   #error Unsupported cell size
 #endif
 
+/* Cells are stored in the file in Little Endian, so on Little Endian
+ * machines the blocks are transferred as is, directly from/to the abstract
+ * machine's memory. On Big Endian machines, the cells are swapped in place.
+ */
+static void alignblock(cell *cptr,cell count)
+{
+  #if BYTE_ORDER==BIG_ENDIAN
+    while (count-->0)
+      aligncell((ucell *)cptr++);
+  #else
+    UNUSED_PARAM(cptr);
+    UNUSED_PARAM(count);
+  #endif
+}
+
 /* fblockwrite(File: handle, buffer[], size=sizeof buffer) */
 static cell AMX_NATIVE_CALL n_fblockwrite(AMX *amx, const cell *params)
 {
   cell *cptr;
-  cell count;
+  cell count=0;
 
   amx_GetAddr(amx,params[2],&cptr);
-  if (cptr!=NULL) {
-    cell max=params[3];
-    ucell v;
-    for (count=0; count<max; count++) {
-      v=(ucell)*cptr++;
-      if (fwrite(aligncell(&v),sizeof(cell),1,(FILE*)params[1])!=1)
-        break;          /* write error */
-    } /* for */
+  if (cptr!=NULL && params[3]>0) {
+    alignblock(cptr,params[3]);
+    count=(cell)fwrite(cptr,sizeof(cell),(size_t)params[3],(FILE*)params[1]);
+    alignblock(cptr,params[3]); /* restore the buffer */
   } /* if */
   return count;
 }
@@ -577,17 +633,12 @@ static cell AMX_NATIVE_CALL n_fblockwrite(AMX *amx, const cell *params)
 static cell AMX_NATIVE_CALL n_fblockread(AMX *amx, const cell *params)
 {
   cell *cptr;
-  cell count;
+  cell count=0;
 
   amx_GetAddr(amx,params[2],&cptr);
-  if (cptr!=NULL) {
-    cell max=params[3];
-    ucell v;
-    for (count=0; count<max; count++) {
-      if (fread(&v,sizeof(cell),1,(FILE*)params[1])!=1)
-        break;          /* write error */
-      *cptr++=(cell)*aligncell(&v);
-    } /* for */
+  if (cptr!=NULL && params[3]>0) {
+    count=(cell)fread(cptr,sizeof(cell),(size_t)params[3],(FILE*)params[1]);
+    alignblock(cptr,count);
   } /* if */
   return count;
 }
@@ -647,69 +698,250 @@ static cell AMX_NATIVE_CALL n_flength(AMX *amx, const cell *params)
   return l;
 }
 
-static int match_optcopy(TCHAR *out,int outlen,const TCHAR *in,int skip)
+/* The names that match a pattern are cached per directory and pattern, so
+ * that enumerating a directory with fmatch() does not scan the directory
+ * again for every index. A snapshot is dropped when the modification time
+ * of the directory changes. Directories that were modified very recently are
+ * not cached at all, because a change in the same time stamp tick would go
+ * unnoticed. The snapshots are shared by all threads and all abstract
+ * machines; they are freed when the program exits.
+ */
+#if !defined AMXFILE_MATCHCACHE
+  #define AMXFILE_MATCHCACHE 8  /* number of directory snapshots */
+#endif
+#define MATCHCACHE_SETTLE 2     /* seconds before a directory is cached */
+
+#if defined __WIN32__
+  typedef FILETIME DIRSTAMP;
+#else
+  typedef struct tagDIRSTAMP {
+    time_t sec;
+    long nsec;
+  } DIRSTAMP;
+#endif
+
+typedef struct tagMATCHCACHE {
+  TCHAR *path;                  /* directory plus pattern; NULL if unused */
+  DIRSTAMP stamp;
+  TCHAR **names;
+  int count;
+  unsigned long lastuse;
+} MATCHCACHE;
+
+static MATCHCACHE matchcache[AMXFILE_MATCHCACHE];
+static unsigned long matchcache_clock=0;
+static int matchcache_atexit=0;
+
+#if defined __WIN32__
+  static SRWLOCK matchcache_lock=SRWLOCK_INIT;
+  #define lockmatchcache()    AcquireSRWLockExclusive(&matchcache_lock)
+  #define unlockmatchcache()  ReleaseSRWLockExclusive(&matchcache_lock)
+#else
+  static pthread_mutex_t matchcache_lock=PTHREAD_MUTEX_INITIALIZER;
+  #define lockmatchcache()    pthread_mutex_lock(&matchcache_lock)
+  #define unlockmatchcache()  pthread_mutex_unlock(&matchcache_lock)
+#endif
+
+/* get the modification time of a directory, returns 0 if it is too recent
+ * to be cached (or on failure)
+ */
+static int getdirstamp(const TCHAR *dirname,DIRSTAMP *stamp)
 {
-  if (out==NULL || skip!=0 || outlen<=0)
+  #if defined __WIN32__
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    FILETIME now;
+    ULARGE_INTEGER t1,t2;
+
+    if (!GetFileAttributesEx(dirname,GetFileExInfoStandard,&attr))
+      return 0;
+    *stamp=attr.ftLastWriteTime;
+    GetSystemTimeAsFileTime(&now);
+    t1.LowPart=stamp->dwLowDateTime;
+    t1.HighPart=stamp->dwHighDateTime;
+    t2.LowPart=now.dwLowDateTime;
+    t2.HighPart=now.dwHighDateTime;
+    return t2.QuadPart>t1.QuadPart+MATCHCACHE_SETTLE*10000000uL;  /* 100ns units */
+  #else
+    struct stat st;
+
+    if (stat(dirname,&st)!=0)
+      return 0;
+    stamp->sec=st.st_mtime;
+    #if defined LINUX
+      stamp->nsec=st.st_mtim.tv_nsec;
+    #else
+      stamp->nsec=0;
+    #endif
+    return time(NULL)>stamp->sec+MATCHCACHE_SETTLE;
+  #endif
+}
+
+static int samedirstamp(const DIRSTAMP *a,const DIRSTAMP *b)
+{
+  #if defined __WIN32__
+    return CompareFileTime(a,b)==0;
+  #else
+    return a->sec==b->sec && a->nsec==b->nsec;
+  #endif
+}
+
+static void freematches(MATCHCACHE *cache)
+{
+  int i;
+
+  for (i=0; i<cache->count; i++)
+    free(cache->names[i]);
+  free(cache->names);
+  free(cache->path);
+  cache->path=NULL;
+  cache->names=NULL;
+  cache->count=0;
+}
+
+static void freematchcache(void)
+{
+  int i;
+
+  lockmatchcache();
+  for (i=0; i<AMXFILE_MATCHCACHE; i++)
+    if (matchcache[i].path!=NULL)
+      freematches(&matchcache[i]);
+  unlockmatchcache();
+}
+
+static int addmatch(MATCHCACHE *cache,const TCHAR *name,int *size)
+{
+  TCHAR **names;
+
+  if (cache->count==*size) {
+    *size=(*size==0) ? 16 : 2*(*size);
+    if ((names=(TCHAR**)realloc(cache->names,*size*sizeof(TCHAR*)))==NULL)
+      return 0;
+    cache->names=names;
+  } /* if */
+  if ((cache->names[cache->count]=_tcsdup(name))==NULL)
     return 0;
-  _tcsncpy(out,in,outlen);
-  out[outlen-1]='\0';
+  cache->count++;
   return 1;
 }
 
-static int matchfiles(const TCHAR *path,int skip,TCHAR *out,int outlen)
+/* scan the directory and fill "cache" with all names matching the pattern */
+static void scanmatches(MATCHCACHE *cache,const TCHAR *path,const TCHAR *dirname,const TCHAR *basename)
 {
-  int count=0;
-  const TCHAR *basename;
-  #if DIRSEP_CHAR!='/'
-    TCHAR *ptr;
-  #endif
+  int size=0;
   #if defined __WIN32__
     HANDLE hfind;
     WIN32_FIND_DATA fd;
   #else
-    /* assume LINUX, FreeBSD, OpenBSD, or some other variant */
     DIR *dir;
     struct dirent *entry;
-    TCHAR dirname[_MAX_PATH];
-  #endif
-
-  basename=_tcsrchr(path,DIRSEP_CHAR);
-  basename=(basename==NULL) ? path : basename+1;
-  #if DIRSEP_CHAR!='/'
-    ptr=_tcsrchr(basename,DIRSEP_CHAR);
-    basename=(ptr==NULL) ? basename : ptr+1;
   #endif
 
   #if defined __WIN32__
+    UNUSED_PARAM(dirname);
     if ((hfind=FindFirstFile(path,&fd))!=INVALID_HANDLE_VALUE) {
       do {
-        if (fpattern_match(basename,fd.cFileName,-1,FALSE)) {
-          count++;
-          if (match_optcopy(out,outlen,fd.cFileName,skip--))
+        if (fpattern_match(basename,fd.cFileName,-1,FALSE))
+          if (!addmatch(cache,fd.cFileName,&size))
             break;
-        } /* if */
       } while (FindNextFile(hfind,&fd));
       FindClose(hfind);
     } /* if */
   #else
-    /* copy directory part only (zero-terminate) */
-    if (basename==path) {
-      strcpy(dirname,".");
-    } else {
-      strncpy(dirname,path,(int)(basename-path));
-      dirname[(int)(basename-path)]=__T('\0');
-    } /* if */
+    UNUSED_PARAM(path);
     if ((dir=opendir(dirname))!=NULL) {
       while ((entry=readdir(dir))!=NULL) {
-        if (fpattern_match(basename,entry->d_name,-1,TRUE)) {
-          count++;
-          if (match_optcopy(out,outlen,entry->d_name,skip--))
+        if (fpattern_match(basename,entry->d_name,-1,TRUE))
+          if (!addmatch(cache,entry->d_name,&size))
             break;
-        } /* if */
       } /* while */
       closedir(dir);
     } /* if */
   #endif
+}
+
+/* copy the match at index "skip" into "out", return the number of matches */
+static int copymatch(const MATCHCACHE *cache,int skip,TCHAR *out,int outlen)
+{
+  if (out!=NULL && outlen>0 && skip>=0 && skip<cache->count) {
+    _tcsncpy(out,cache->names[skip],outlen);
+    out[outlen-1]='\0';
+  } /* if */
+  return cache->count;
+}
+
+/* Return the number of files that match "path" and copy the name of the
+ * match at index "skip" into "out" (if "out" is not NULL and there are
+ * more than "skip" matches). "out" may be the same buffer as "path".
+ */
+static int matchfiles(const TCHAR *path,int skip,TCHAR *out,int outlen)
+{
+  MATCHCACHE *cache,temp;
+  DIRSTAMP stamp;
+  int i,count;
+  const TCHAR *basename;
+  #if DIRSEP_CHAR!='/'
+    TCHAR *ptr;
+  #endif
+  TCHAR dirname[_MAX_PATH];
+
+  basename=_tcsrchr(path,DIRSEP_CHAR);
+  basename=(basename==NULL) ? path : basename+1;
+  #if DIRSEP_CHAR!='/'
+    ptr=_tcsrchr(basename,DIRSEP_CHAR);
+    basename=(ptr==NULL) ? basename : ptr+1;
+  #endif
+
+  /* copy directory part only (zero-terminate) */
+  if (basename==path) {
+    _tcscpy(dirname,__T("."));
+  } else {
+    _tcsncpy(dirname,path,(int)(basename-path));
+    dirname[(int)(basename-path)]=__T('\0');
+  } /* if */
+
+  if (!getdirstamp(dirname,&stamp)) {
+    /* use a snapshot for this call only */
+    cache=&temp;
+    cache->path=NULL;
+    cache->names=NULL;
+    cache->count=0;
+    scanmatches(cache,path,dirname,basename);
+    count=copymatch(cache,skip,out,outlen);
+    freematches(cache);
+    return count;
+  } /* if */
+
+  /* look up the snapshot; if there is none, replace the least recently used
+   * one
+   */
+  lockmatchcache();
+  if (!matchcache_atexit)
+    matchcache_atexit=(atexit(freematchcache)==0);
+  cache=&matchcache[0];
+  for (i=0; i<AMXFILE_MATCHCACHE; i++) {
+    if (matchcache[i].path!=NULL && _tcscmp(matchcache[i].path,path)==0) {
+      cache=&matchcache[i];
+      break;
+    } /* if */
+    if (matchcache[i].lastuse<cache->lastuse)
+      cache=&matchcache[i];
+  } /* for */
+  if (cache->path==NULL || _tcscmp(cache->path,path)!=0
+      || !samedirstamp(&cache->stamp,&stamp))
+  {
+    if (cache->path!=NULL)
+      freematches(cache);
+    if ((cache->path=_tcsdup(path))==NULL) {
+      unlockmatchcache();
+      return 0;
+    } /* if */
+    cache->stamp=stamp;
+    scanmatches(cache,path,dirname,basename);
+  } /* if */
+  cache->lastuse=++matchcache_clock;
+  count=copymatch(cache,skip,out,outlen);
+  unlockmatchcache();
   return count;
 }
 
@@ -733,7 +965,7 @@ static cell AMX_NATIVE_CALL n_fmatch(AMX *amx, const cell *params)
 
   amx_StrParam(amx,params[2],name);
   if (name!=NULL && completename(fullname,name,sizeof fullname)!=NULL) {
-    if (!matchfiles(fullname,params[3],fullname,sizeof fullname)) {
+    if (params[3]<0 || matchfiles(fullname,params[3],fullname,sizeof fullname)<=params[3]) {
       fullname[0]='\0';
     } else {
       /* copy the string into the destination */
@@ -744,6 +976,226 @@ static cell AMX_NATIVE_CALL n_fmatch(AMX *amx, const cell *params)
   return fullname[0]!='\0';
 }
 
+/* A read-only memory mapping of a complete file. The pages are shared with
+ * the operating system's file cache, so nothing is copied until a script
+ * reads from the map.
+ */
+typedef struct tagFILEMAP {
+  const unsigned char *base;
+  size_t length;
+  #if defined __WIN32__
+    HANDLE hmap;
+  #endif
+} FILEMAP;
+
+static FILEMAP *mapfile(const TCHAR *name)
+{
+  FILEMAP *map;
+  #if defined __WIN32__
+    HANDLE hfile;
+    DWORD high;
+  #else
+    struct stat st;
+    void *base;
+    int fd;
+  #endif
+
+  if ((map=(FILEMAP*)malloc(sizeof(FILEMAP)))==NULL)
+    return NULL;
+  map->base=NULL;
+  map->length=0;
+
+  #if defined __WIN32__
+    map->hmap=NULL;
+    hfile=CreateFile(name,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+    if (hfile==INVALID_HANDLE_VALUE) {
+      free(map);
+      return NULL;
+    } /* if */
+    map->length=GetFileSize(hfile,&high);
+    if (high!=0) {
+      /* files of 4 GiB and over cannot be addressed by a cell anyway */
+      CloseHandle(hfile);
+      free(map);
+      return NULL;
+    } /* if */
+    if (map->length>0) {
+      map->hmap=CreateFileMapping(hfile,NULL,PAGE_READONLY,0,0,NULL);
+      if (map->hmap!=NULL)
+        map->base=(const unsigned char*)MapViewOfFile(map->hmap,FILE_MAP_READ,0,0,0);
+      if (map->base==NULL) {
+        if (map->hmap!=NULL)
+          CloseHandle(map->hmap);
+        CloseHandle(hfile);
+        free(map);
+        return NULL;
+      } /* if */
+    } /* if */
+    CloseHandle(hfile);
+  #else
+    if ((fd=open(name,O_RDONLY))<0) {
+      free(map);
+      return NULL;
+    } /* if */
+    if (fstat(fd,&st)!=0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      free(map);
+      return NULL;
+    } /* if */
+    map->length=(size_t)st.st_size;
+    if (map->length>0) {
+      /* an empty file cannot be mapped, it simply has a NULL base */
+      base=mmap(NULL,map->length,PROT_READ,MAP_SHARED,fd,0);
+      if (base==MAP_FAILED) {
+        close(fd);
+        free(map);
+        return NULL;
+      } /* if */
+      map->base=(const unsigned char*)base;
+    } /* if */
+    close(fd);                  /* the mapping stays valid */
+  #endif
+  return map;
+}
+
+static void unmapfile(FILEMAP *map)
+{
+  #if defined __WIN32__
+    if (map->base!=NULL)
+      UnmapViewOfFile(map->base);
+    if (map->hmap!=NULL)
+      CloseHandle(map->hmap);
+  #else
+    if (map->base!=NULL)
+      munmap((void*)map->base,map->length);
+  #endif
+  free(map);
+}
+
+/* Get the physical address of "cells" cells at "amx_addr", after checking
+ * that the last cell is valid too.
+ */
+static cell *getblockaddr(AMX *amx,cell amx_addr,size_t cells)
+{
+  cell *cptr,*last;
+
+  if (amx_GetAddr(amx,amx_addr,&cptr)!=AMX_ERR_NONE)
+    return NULL;
+  if (cells>1 && amx_GetAddr(amx,amx_addr+(cell)((cells-1)*sizeof(cell)),&last)!=AMX_ERR_NONE)
+    return NULL;
+  return cptr;
+}
+
+/* FileMap: fmap(const name[]) */
+static cell AMX_NATIVE_CALL n_fmap(AMX *amx, const cell *params)
+{
+  TCHAR *name,fullname[_MAX_PATH];
+  FILEMAP *map=NULL;
+
+  amx_StrParam(amx,params[1],name);
+  if (name!=NULL && completename(fullname,name,sizeof fullname)!=NULL)
+    map=mapfile(fullname);
+  return (cell)map;
+}
+
+/* bool: funmap(FileMap: handle) */
+static cell AMX_NATIVE_CALL n_funmap(AMX *amx, const cell *params)
+{
+  UNUSED_PARAM(amx);
+  if ((FILEMAP*)params[1]==NULL)
+    return 0;
+  unmapfile((FILEMAP*)params[1]);
+  return 1;
+}
+
+/* fmaplength(FileMap: handle) */
+static cell AMX_NATIVE_CALL n_fmaplength(AMX *amx, const cell *params)
+{
+  UNUSED_PARAM(amx);
+  if ((FILEMAP*)params[1]==NULL)
+    return 0;
+  return (cell)((FILEMAP*)params[1])->length;
+}
+
+/* fmapread(FileMap: handle, buffer[], offset, size=sizeof buffer) */
+static cell AMX_NATIVE_CALL n_fmapread(AMX *amx, const cell *params)
+{
+  FILEMAP *map=(FILEMAP*)params[1];
+  size_t offset,count;
+  cell *cptr;
+
+  if (map==NULL || params[3]<0 || params[4]<=0)
+    return 0;
+  offset=(size_t)params[3];
+  if (offset>=map->length)
+    return 0;
+  count=(map->length-offset)/sizeof(cell);
+  if (count>(size_t)params[4])
+    count=(size_t)params[4];
+  if (count==0)
+    return 0;
+
+  if ((cptr=getblockaddr(amx,params[2],count))==NULL) {
+    amx_RaiseError(amx,AMX_ERR_NATIVE);
+    return 0;
+  } /* if */
+  memcpy(cptr,map->base+offset,count*sizeof(cell));
+  alignblock(cptr,(cell)count);
+  return (cell)count;
+}
+
+/* fmapstring(FileMap: handle, string[], offset, length=cellmax, size=sizeof string, bool:pack=false) */
+static cell AMX_NATIVE_CALL n_fmapstring(AMX *amx, const cell *params)
+{
+  FILEMAP *map=(FILEMAP*)params[1];
+  const unsigned char *source;
+  size_t offset,max,len;
+  cell *cptr;
+
+  if (map==NULL || params[3]<0 || params[4]<0 || params[5]<=0)
+    return 0;
+  offset=(size_t)params[3];
+  if (offset>map->length)
+    return 0;
+  /* the string ends at a zero byte, after "length" bytes or at the end of
+   * the file, whichever comes first; it is truncated to fit in "size"
+   */
+  max=map->length-offset;
+  if (max>(size_t)params[4])
+    max=(size_t)params[4];
+  source=map->base+offset;
+  for (len=0; len<max && source[len]!='\0'; len++)
+    /* nothing */;
+
+  if (params[6]) {
+    if (len>=(size_t)params[5]*sizeof(cell))
+      len=(size_t)params[5]*sizeof(cell)-1;
+    if ((cptr=getblockaddr(amx,params[2],len/sizeof(cell)+1))==NULL) {
+      amx_RaiseError(amx,AMX_ERR_NATIVE);
+      return 0;
+    } /* if */
+    /* pack the bytes straight into the cells, the first byte in the most
+     * significant position (as amx_SetString() does); the cells that are
+     * cleared first also hold the terminating zero byte
+     */
+    memset(cptr,0,(len/sizeof(cell)+1)*sizeof(cell));
+    for (max=0; max<len; max++)
+      cptr[max/sizeof(cell)]|=(cell)((ucell)source[max]<<((sizeof(cell)-1-max%sizeof(cell))*8));
+  } else {
+    /* bytes are stored unsigned, as fblockread and fread do */
+    if (len>=(size_t)params[5])
+      len=(size_t)params[5]-1;
+    if ((cptr=getblockaddr(amx,params[2],len+1))==NULL) {
+      amx_RaiseError(amx,AMX_ERR_NATIVE);
+      return 0;
+    } /* if */
+    for (max=0; max<len; max++)
+      cptr[max]=source[max];
+    cptr[len]=0;
+  } /* if */
+  return (cell)len;
+}
+
 
 #if defined __cplusplus
   extern "C"
@@ -763,6 +1215,11 @@ AMX_NATIVE_INFO file_Natives[] = {
   { "fremove",     n_fremove },
   { "fexist",      n_fexist },
   { "fmatch",      n_fmatch },
+  { "fmap",        n_fmap },
+  { "funmap",      n_funmap },
+  { "fmaplength",  n_fmaplength },
+  { "fmapread",    n_fmapread },
+  { "fmapstring",  n_fmapstring },
   { NULL, NULL }        /* terminator */
 };
 
@@ -773,6 +1230,9 @@ int AMXEXPORT amx_FileInit(AMX *amx)
 
 int AMXEXPORT amx_FileCleanup(AMX *amx)
 {
+  /* the fmatch() cache is shared with other abstract machines and freed at
+   * exit
+   */
   UNUSED_PARAM(amx);
   return AMX_ERR_NONE;
 }
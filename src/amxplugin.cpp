@@ -328,5 +328,28 @@ int AMXAPI amx_UTF8Put(char *string, char **endptr, int maxchars, cell value)
 	return fn(string, endptr, maxchars, value);
 }
 
+// Plugin runner extensions
+
+typedef int  AMXAPI (*amx_PushArgs_t)(AMX *amx, const cell args[], int numargs);
+int AMXAPI amx_PushArgs(AMX *amx, const cell args[], int numargs)
+{
+	amx_PushArgs_t fn = ((amx_PushArgs_t*)pAMXFunctions)[PLUGIN_AMX_EXPORT_PushArgs];
+	return fn(amx, args, numargs);
+}
+
+typedef int  AMXAPI (*amx_PrepareCall_t)(AMX *amx, const char *funcname, AMX_CALL *call);
+int AMXAPI amx_PrepareCall(AMX *amx, const char *funcname, AMX_CALL *call)
+{
+	amx_PrepareCall_t fn = ((amx_PrepareCall_t*)pAMXFunctions)[PLUGIN_AMX_EXPORT_PrepareCall];
+	return fn(amx, funcname, call);
+}
+
+typedef int  AMXAPI (*amx_ExecCall_t)(const AMX_CALL *call, cell *retval, const cell args[], int numargs);
+int AMXAPI amx_ExecCall(const AMX_CALL *call, cell *retval, const cell args[], int numargs)
+{
+	amx_ExecCall_t fn = ((amx_ExecCall_t*)pAMXFunctions)[PLUGIN_AMX_EXPORT_ExecCall];
+	return fn(call, retval, args, numargs);
+}
+
 //----------------------------------------------------------
 // EOF
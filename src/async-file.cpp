@@ -0,0 +1,494 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "async-file.h"
+#include "coroutines.h"
+#include "amx/amx.h"
+#include "amx/osdefs.h"
+
+extern "C" {
+  char *AMXEXPORT amx_FileCompleteName(char *dest,
+                                       const char *name,
+                                       size_t size);
+}
+
+namespace {
+
+const std::size_t NUM_WORKERS = 4;
+
+// Same as in file.inc.
+enum FileMode {
+  io_read,
+  io_write,
+  io_readwrite,
+  io_append
+};
+
+enum CompletionType {
+  COMPLETION_OPEN,
+  COMPLETION_READ,
+  COMPLETION_WRITE,
+  COMPLETION_CLOSE
+};
+
+struct Completion {
+  CompletionType type;
+  AMX *amx;
+  std::string callback;
+  cell tag;
+  cell handle;
+  cell result;
+  bool pack;
+  std::string data;
+};
+
+class Worker {
+ public:
+  Worker(): stop_(false), thread_(&Worker::Run, this) {}
+
+  // Runs the remaining jobs before returning.
+  ~Worker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+  }
+
+  void Post(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+    }
+    cond_.notify_one();
+  }
+
+ private:
+  void Run() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> jobs_;
+  bool stop_;
+  std::thread thread_;
+};
+
+std::vector<std::unique_ptr<Worker>> workers;
+std::size_t next_worker = 0;
+std::vector<AMX *> amx_list;
+
+std::mutex completions_mutex;
+std::vector<Completion> completions;
+std::atomic<int> num_pending{0};
+
+FILE *ToFile(cell handle) {
+  return reinterpret_cast<FILE *>(static_cast<std::intptr_t>(handle));
+}
+
+cell FromFile(FILE *file) {
+  return static_cast<cell>(reinterpret_cast<std::intptr_t>(file));
+}
+
+// Operations on one file are kept in order by always giving them to the same
+// worker.
+Worker *GetWorker(cell handle) {
+  auto key = static_cast<std::size_t>(static_cast<ucell>(handle));
+  return workers[(key / sizeof(void *)) % workers.size()].get();
+}
+
+Worker *GetNextWorker() {
+  return workers[next_worker++ % workers.size()].get();
+}
+
+void MakeCompletion(AMX *amx,
+                    CompletionType type,
+                    cell callback,
+                    cell tag,
+                    Completion &completion) {
+  char *name;
+  amx_StrParam(amx, callback, name);
+  completion.type = type;
+  completion.amx = amx;
+  completion.callback = name != nullptr ? name : "";
+  completion.tag = tag;
+  completion.handle = 0;
+  completion.result = 0;
+  completion.pack = false;
+}
+
+void Post(Worker *worker, std::function<void()> job) {
+  num_pending++;
+  worker->Post(std::move(job));
+}
+
+void Complete(Completion &completion) {
+  std::lock_guard<std::mutex> lock(completions_mutex);
+  completions.push_back(std::move(completion));
+}
+
+// Reads a line of at most max_bytes bytes. In UTF-8 mode the last character
+// is completed even if that takes a few bytes more.
+std::string ReadLine(FILE *file, std::size_t max_bytes, bool utf8) {
+  std::string line;
+  if (max_bytes == 0) {
+    return line;
+  }
+  std::vector<char> buffer(max_bytes + 1);
+  if (std::fgets(buffer.data(), static_cast<int>(buffer.size()), file)
+      == nullptr) {
+    return line;
+  }
+  line.assign(buffer.data());
+  if (utf8 && !line.empty() && line.back() != '\n') {
+    std::size_t lead = line.length();
+    while (lead > 0 && line.length() - lead < 6) {
+      unsigned char c = static_cast<unsigned char>(line[--lead]);
+      if ((c & 0xc0) != 0x80) {
+        std::size_t length = 1;
+        if ((c & 0xe0) == 0xc0) length = 2;
+        else if ((c & 0xf0) == 0xe0) length = 3;
+        else if ((c & 0xf8) == 0xf0) length = 4;
+        else if ((c & 0xfc) == 0xf8) length = 5;
+        else if ((c & 0xfe) == 0xfc) length = 6;
+        std::size_t have = line.length() - lead;
+        if (have < length) {
+          char rest[6];
+          std::size_t n = std::fread(rest, 1, length - have, file);
+          line.append(rest, n);
+        }
+        break;
+      }
+    }
+  }
+  return line;
+}
+
+// Encodes a string from the abstract machine the same way as fwrite() does:
+// packed strings are written as they are, unpacked strings as UTF-8.
+bool GetWriteData(AMX *amx, cell string, std::string &data, cell &length) {
+  cell *cptr;
+  int len;
+  if (amx_GetAddr(amx, string, &cptr) != AMX_ERR_NONE) {
+    return false;
+  }
+  amx_StrLen(cptr, &len);
+  length = len;
+  if (static_cast<ucell>(*cptr) > UNPACKEDMAX) {
+    data.resize(len + 1);
+    amx_GetString(&data[0], cptr, 0, len + 1);
+    data.resize(len);
+  } else {
+    data.reserve(len);
+    for (int i = 0; i < len; i++) {
+      char buffer[6];
+      char *end;
+      amx_UTF8Put(buffer, &end, sizeof(buffer), cptr[i]);
+      data.append(buffer, end);
+    }
+  }
+  return true;
+}
+
+void PushReadData(AMX *amx, const Completion &completion, cell &heap_addr) {
+  cell *phys_addr;
+  if (completion.pack) {
+    amx_PushString(amx, &heap_addr, &phys_addr,
+                   completion.data.c_str(), 1, 0);
+    return;
+  }
+  std::vector<cell> cells;
+  cells.reserve(completion.data.length() + 1);
+  const char *s = completion.data.c_str();
+  if (amx_UTF8Check(s, nullptr) == AMX_ERR_NONE) {
+    while (*s != '\0') {
+      cell c;
+      amx_UTF8Get(s, &s, &c);
+      cells.push_back(c);
+    }
+  } else {
+    for (auto c : completion.data) {
+      cells.push_back(static_cast<unsigned char>(c));
+    }
+  }
+  cells.push_back(0);
+  amx_PushArray(amx, &heap_addr, &phys_addr,
+                cells.data(), static_cast<int>(cells.size()));
+}
+
+void CallCompletion(const Completion &completion) {
+  AMX *amx = completion.amx;
+  int index;
+  if (completion.callback.empty()
+      || amx_FindPublic(amx, completion.callback.c_str(), &index)
+         != AMX_ERR_NONE) {
+    return;
+  }
+
+  // Arguments are pushed in reverse order.
+  cell heap_addr = -1;
+  switch (completion.type) {
+    case COMPLETION_OPEN:
+      // callback(tag, File: handle)
+      amx_Push(amx, completion.handle);
+      break;
+    case COMPLETION_READ:
+      // callback(tag, File: handle, const string[], length)
+      amx_Push(amx, completion.result);
+      PushReadData(amx, completion, heap_addr);
+      amx_Push(amx, completion.handle);
+      break;
+    case COMPLETION_WRITE:
+      // callback(tag, File: handle, length)
+      amx_Push(amx, completion.result);
+      amx_Push(amx, completion.handle);
+      break;
+    case COMPLETION_CLOSE:
+      // callback(tag, bool: success)
+      amx_Push(amx, completion.result);
+      break;
+  }
+  amx_Push(amx, completion.tag);
+
+  cell retval;
+  int error = ExecScript(amx, &retval, index);
+  if (error != AMX_ERR_NONE) {
+    std::printf("Error while executing %s: %d\n",
+                completion.callback.c_str(), error);
+  }
+  if (heap_addr != -1) {
+    amx_Release(amx, heap_addr);
+  }
+}
+
+// bool: fopen_async(const name[], filemode: mode, const callback[], tag = 0)
+cell AMX_NATIVE_CALL n_fopen_async(AMX *amx, const cell *params) {
+  const char *mode;
+  const char *alt_mode = nullptr;
+  switch (params[2] & 0x7fff) {
+    case io_read:
+      mode = "rb";
+      break;
+    case io_write:
+      mode = "wb";
+      break;
+    case io_readwrite:
+      mode = "r+b";
+      alt_mode = "w+b";
+      break;
+    case io_append:
+      mode = "ab";
+      break;
+    default:
+      return 0;
+  }
+
+  char *name;
+  char full_name[_MAX_PATH];
+  amx_StrParam(amx, params[1], name);
+  if (name == nullptr
+      || amx_FileCompleteName(full_name, name, sizeof(full_name)) == nullptr) {
+    return 0;
+  }
+
+  Completion completion;
+  MakeCompletion(amx, COMPLETION_OPEN, params[3], params[4], completion);
+  std::string path = full_name;
+  Post(GetNextWorker(), [=]() mutable {
+    FILE *file = std::fopen(path.c_str(), mode);
+    if (file == nullptr && alt_mode != nullptr) {
+      file = std::fopen(path.c_str(), alt_mode);
+    }
+    completion.handle = FromFile(file);
+    completion.result = file != nullptr;
+    Complete(completion);
+  });
+  return 1;
+}
+
+// bool: fread_async(File: handle, size, const callback[], tag = 0,
+//                   bool: pack = false)
+cell AMX_NATIVE_CALL n_fread_async(AMX *amx, const cell *params) {
+  if (params[1] == 0 || params[2] <= 0) {
+    return 0;
+  }
+
+  Completion completion;
+  MakeCompletion(amx, COMPLETION_READ, params[3], params[4], completion);
+  completion.handle = params[1];
+  completion.pack = params[5] != 0;
+  std::size_t max_bytes = static_cast<std::size_t>(params[2]);
+  if (completion.pack) {
+    max_bytes *= sizeof(cell);
+  }
+  max_bytes--; // room for the terminating zero
+  Post(GetWorker(params[1]), [=]() mutable {
+    completion.data =
+      ReadLine(ToFile(completion.handle), max_bytes, !completion.pack);
+    if (!completion.pack) {
+      int length;
+      if (amx_UTF8Check(completion.data.c_str(), &length) == AMX_ERR_NONE) {
+        completion.result = length;
+      } else {
+        completion.result = static_cast<cell>(completion.data.length());
+      }
+    } else {
+      completion.result = static_cast<cell>(completion.data.length());
+    }
+    Complete(completion);
+  });
+  return 1;
+}
+
+// bool: fwrite_async(File: handle, const string[], const callback[] = "",
+//                    tag = 0)
+cell AMX_NATIVE_CALL n_fwrite_async(AMX *amx, const cell *params) {
+  if (params[1] == 0) {
+    return 0;
+  }
+
+  // The string is copied now, so the script may reuse its buffer right away.
+  Completion completion;
+  cell length;
+  if (!GetWriteData(amx, params[2], completion.data, length)) {
+    return 0;
+  }
+  MakeCompletion(amx, COMPLETION_WRITE, params[3], params[4], completion);
+  completion.handle = params[1];
+  Post(GetWorker(params[1]), [=]() mutable {
+    std::size_t size = completion.data.length();
+    if (size > 0
+        && std::fwrite(completion.data.data(), 1, size,
+                       ToFile(completion.handle)) != size) {
+      length = 0;
+    }
+    completion.result = length;
+    completion.data.clear();
+    Complete(completion);
+  });
+  return 1;
+}
+
+// bool: fclose_async(File: handle, const callback[] = "", tag = 0)
+cell AMX_NATIVE_CALL n_fclose_async(AMX *amx, const cell *params) {
+  if (params[1] == 0) {
+    return 0;
+  }
+
+  Completion completion;
+  MakeCompletion(amx, COMPLETION_CLOSE, params[2], params[3], completion);
+  completion.handle = params[1];
+  Post(GetWorker(params[1]), [=]() mutable {
+    completion.result = std::fclose(ToFile(completion.handle)) == 0;
+    Complete(completion);
+  });
+  return 1;
+}
+
+} // anonymous namespace
+
+int AsyncFileInit(AMX *amx) {
+  if (workers.empty()) {
+    for (std::size_t i = 0; i < NUM_WORKERS; i++) {
+      workers.emplace_back(new Worker);
+    }
+  }
+  amx_list.push_back(amx);
+
+  static const AMX_NATIVE_INFO natives[] = {
+    "fopen_async", n_fopen_async,
+    "fread_async", n_fread_async,
+    "fwrite_async", n_fwrite_async,
+    "fclose_async", n_fclose_async
+  };
+  int num_natives = static_cast<int>(sizeof(natives) / sizeof(natives[0]));
+  return amx_Register(amx, natives, num_natives);
+}
+
+int AsyncFileCleanup(AMX *amx) {
+  amx_list.erase(std::remove(amx_list.begin(), amx_list.end(), amx),
+                 amx_list.end());
+  if (amx_list.empty()) {
+    // Let the workers finish whatever was queued, so that nothing that was
+    // written is lost.
+    workers.clear();
+  }
+
+  std::lock_guard<std::mutex> lock(completions_mutex);
+  auto end = std::remove_if(completions.begin(), completions.end(),
+    [amx](const Completion &completion) {
+      return completion.amx == amx;
+    });
+  num_pending -= static_cast<int>(completions.end() - end);
+  completions.erase(end, completions.end());
+  return AMX_ERR_NONE;
+}
+
+bool HasPendingAsyncFileOps() {
+  return num_pending > 0;
+}
+
+void ProcessAsyncFileCompletions() {
+  std::vector<Completion> ready;
+  {
+    std::lock_guard<std::mutex> lock(completions_mutex);
+    ready.swap(completions);
+  }
+  for (auto &completion : ready) {
+    if (std::find(amx_list.begin(), amx_list.end(), completion.amx)
+        != amx_list.end()) {
+      CallCompletion(completion);
+    }
+    num_pending--;
+  }
+}
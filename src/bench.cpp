@@ -0,0 +1,246 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bench.h"
+#include "snapshot.h"
+#include "amx/amxaux.h"
+
+namespace {
+
+const auto WARMUP_TIME = std::chrono::milliseconds(100);
+const auto MIN_SAMPLE_TIME = std::chrono::milliseconds(10);
+const int NUM_SAMPLES = 20;
+
+// A benchmark is slower than in the baseline if its median is more than this
+// much above the baseline median and the baseline is not even within the
+// confidence interval.
+const double REGRESSION_THRESHOLD = 0.05;
+
+struct Result {
+  std::string name;
+  long iterations;
+  double median;
+  double mad;
+  double ci_low;
+  double ci_high;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  std::size_t middle = values.size() / 2;
+  if (values.size() % 2 == 0) {
+    return (values[middle - 1] + values[middle]) / 2;
+  }
+  return values[middle];
+}
+
+// Calls the public "iterations" times and returns the time taken in
+// nanoseconds, or a negative value if the call failed.
+double TimeCalls(AMX *amx, int index, long iterations, int &amx_error) {
+  auto start = Clock::now();
+  for (long i = 0; i < iterations; i++) {
+    amx_error = amx_Exec(amx, nullptr, index);
+    if (amx_error != AMX_ERR_NONE) {
+      return -1;
+    }
+  }
+  return static_cast<double>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count());
+}
+
+bool RunBenchmark(AMX *amx, int index, Result &result) {
+  int amx_error = AMX_ERR_NONE;
+
+  // Warm up caches and the branch predictor, and find out how many calls
+  // make a batch long enough for the clock.
+  const double min_sample_time = static_cast<double>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      MIN_SAMPLE_TIME).count());
+  long iterations = 1;
+  auto warmup_end = Clock::now() + WARMUP_TIME;
+  double time;
+  while ((time = TimeCalls(amx, index, iterations, amx_error)) >= 0
+         && (time < min_sample_time || Clock::now() < warmup_end)) {
+    if (time < min_sample_time) {
+      iterations *= 2;
+    }
+  }
+
+  std::vector<double> samples;
+  while (amx_error == AMX_ERR_NONE
+         && samples.size() < static_cast<std::size_t>(NUM_SAMPLES)) {
+    double time = TimeCalls(amx, index, iterations, amx_error);
+    if (time >= 0) {
+      samples.push_back(time / iterations);
+    }
+  }
+  if (amx_error != AMX_ERR_NONE) {
+    std::printf("%-32s failed: %s (%d)\n",
+                result.name.c_str(), aux_StrError(amx_error), amx_error);
+    return false;
+  }
+
+  result.iterations = iterations;
+  result.median = Median(samples);
+  std::vector<double> deviations;
+  for (double sample : samples) {
+    deviations.push_back(std::fabs(sample - result.median));
+  }
+  result.mad = Median(deviations);
+
+  // Distribution-free confidence interval for the median: the samples at
+  // ranks n/2 -+ 1.96 * sqrt(n) / 2.
+  std::sort(samples.begin(), samples.end());
+  double n = static_cast<double>(samples.size());
+  double spread = 1.96 * std::sqrt(n) / 2;
+  auto low = static_cast<std::size_t>(
+    std::max(0.0, std::floor(n / 2 - spread)));
+  auto high = static_cast<std::size_t>(
+    std::min(n - 1, std::ceil(n / 2 + spread) - 1));
+  result.ci_low = samples[low];
+  result.ci_high = samples[high];
+  return true;
+}
+
+// Reads the medians from a file written by WriteJson().
+std::unordered_map<std::string, double> ReadBaseline(const std::string &path) {
+  std::unordered_map<std::string, double> medians;
+  std::ifstream stream(path);
+  std::string line;
+  const std::string name_key = "\"name\": \"";
+  const std::string median_key = "\"median_ns\": ";
+  while (std::getline(stream, line)) {
+    auto name_pos = line.find(name_key);
+    auto median_pos = line.find(median_key);
+    if (name_pos == std::string::npos || median_pos == std::string::npos) {
+      continue;
+    }
+    name_pos += name_key.length();
+    median_pos += median_key.length();
+    auto name_end = line.find('"', name_pos);
+    double median = 0;
+    if (name_end != std::string::npos
+        && std::sscanf(line.c_str() + median_pos, "%lf", &median) == 1) {
+      medians[line.substr(name_pos, name_end - name_pos)] = median;
+    }
+  }
+  return medians;
+}
+
+// Writes one benchmark per line so that ReadBaseline() can do without a JSON
+// parser.
+bool WriteJson(const std::string &path, const std::vector<Result> &results) {
+  std::FILE *file = std::fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+  std::fprintf(file, "{\n  \"benchmarks\": [\n");
+  for (std::size_t i = 0; i < results.size(); i++) {
+    const Result &result = results[i];
+    std::fprintf(file,
+                 "    {\"name\": \"%s\", \"iterations\": %ld, "
+                 "\"samples\": %d, \"median_ns\": %.3f, \"mad_ns\": %.3f, "
+                 "\"ci_low_ns\": %.3f, \"ci_high_ns\": %.3f}%s\n",
+                 result.name.c_str(), result.iterations, NUM_SAMPLES,
+                 result.median, result.mad, result.ci_low, result.ci_high,
+                 i + 1 < results.size() ? "," : "");
+  }
+  std::fprintf(file, "  ]\n}\n");
+  return std::fclose(file) == 0;
+}
+
+} // anonymous namespace
+
+int RunBenchmarks(AMX *amx, const BenchOptions &options) {
+  std::unordered_map<std::string, double> baseline;
+  if (!options.baseline_path.empty()) {
+    baseline = ReadBaseline(options.baseline_path);
+    if (baseline.empty()) {
+      std::printf("No baseline results in %s\n", options.baseline_path.c_str());
+    }
+  }
+
+  Snapshot snapshot;
+  snapshot.Take(amx);
+
+  int num_publics = 0;
+  amx_NumPublics(amx, &num_publics);
+  std::vector<Result> results;
+  int num_failed = 0;
+  int num_slower = 0;
+  for (int i = 0; i < num_publics; i++) {
+    char name[sNAMEMAX + 1];
+    if (amx_GetPublic(amx, i, name) != AMX_ERR_NONE
+        || std::strncmp(name, options.prefix.c_str(),
+                        options.prefix.length()) != 0) {
+      continue;
+    }
+    Result result;
+    result.name = name;
+    bool ok = RunBenchmark(amx, i, result);
+    snapshot.Restore(amx);
+    if (!ok) {
+      num_failed++;
+      continue;
+    }
+
+    std::printf("%-32s %12.1f ns/op  MAD %.1f  95%% CI %.1f - %.1f  "
+                "(%d x %ld calls)",
+                name, result.median, result.mad, result.ci_low,
+                result.ci_high, NUM_SAMPLES, result.iterations);
+    auto base = baseline.find(result.name);
+    if (base != baseline.end() && base->second > 0) {
+      double change = (result.median - base->second) / base->second;
+      std::printf("  %+.1f%%", change * 100);
+      if (change > REGRESSION_THRESHOLD && result.ci_low > base->second) {
+        std::printf("  SLOWER");
+        num_slower++;
+      }
+    }
+    std::printf("\n");
+    results.push_back(result);
+  }
+
+  if (!options.json_path.empty() && !WriteJson(options.json_path, results)) {
+    std::printf("Could not write benchmark results to %s\n",
+                options.json_path.c_str());
+  }
+  std::printf("%d benchmarks, %d failed, %d slower than baseline\n",
+              static_cast<int>(results.size()) + num_failed, num_failed,
+              num_slower);
+  return num_failed + num_slower;
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <string>
+#include "amx/amx.h"
+
+struct BenchOptions {
+  // Benchmarks are the publics whose names start with this.
+  std::string prefix;
+  // Where to write the results as JSON, if not empty.
+  std::string json_path;
+  // Results of an earlier run (as written to json_path) to compare with.
+  std::string baseline_path;
+};
+
+// Times every benchmark public of a script. Each one is warmed up, then
+// called in batches big enough to be timed reliably, and the time per call
+// is reported as the median of a number of batches along with the median
+// absolute deviation and a 95% confidence interval for the median. The
+// state of the script is restored between benchmarks.
+//
+// Returns the number of benchmarks that failed or are slower than in the
+// baseline.
+int RunBenchmarks(AMX *amx, const BenchOptions &options);
+
+#endif // !BENCH_H
@@ -0,0 +1,354 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "coroutines.h"
+#include "native.h"
+#include "watchdog.h"
+#include "amx/amxaux.h"
+
+namespace {
+
+struct Context {
+  AMX *amx;
+  // The ExecScript() call this context belongs to, see ExecScript().
+  int call;
+  bool ready;
+  cell result;
+  // Registers saved by amx_Exec() when the call went to sleep.
+  cell cip;
+  cell frm;
+  cell stk;
+  cell hea;
+  cell alt;
+  cell reset_stk;
+  cell reset_hea;
+  // Used part of the stack (stk to stp) and of the heap (hlw to hea).
+  std::vector<cell> stack;
+  std::vector<cell> heap;
+};
+
+// The outcome of a suspended call whose caller asked for it.
+struct CallResult {
+  bool finished;
+  int error;
+  cell retval;
+};
+
+std::unordered_map<int, Context> contexts;
+std::deque<int> ready_contexts;
+int next_id = 1;
+
+// Calls whose outcome is waited for, by call id.
+std::unordered_map<int, CallResult> call_results;
+
+// The call that ProcessCoroutines() is continuing.
+int resumed_call = 0;
+
+// Instruction budget of top-level calls, 0 if unlimited.
+long timeslice = 0;
+
+// The AMX instances currently executing through ExecScript() and the
+// context that is about to be suspended in each of them, if any.
+std::unordered_map<AMX *, int> running;
+
+// Scripts waiting in wait_ms(), by the time they should wake up.
+std::multimap<std::uint64_t, int> sleepers;
+
+std::uint64_t Now() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+unsigned char *GetData(AMX *amx) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  return amx->data != nullptr ? amx->data : amx->base + hdr->dat;
+}
+
+cell ReadCell(unsigned char *data, cell addr) {
+  return *reinterpret_cast<cell *>(data + addr);
+}
+
+// Checks that the native being executed was called from a function that
+// amx_Exec() entered with an empty stack, i.e. not from a nested call. Each
+// entry of amx_Exec() leaves a frame with a zero return address; the
+// arguments of that frame must end at the top of the stack.
+bool IsTopLevelCall(AMX *amx) {
+  unsigned char *data = GetData(amx);
+  cell frm = amx->frm;
+  for (;;) {
+    if (frm < amx->stk || frm > amx->stp - 3 * static_cast<cell>(sizeof(cell))) {
+      return false;
+    }
+    if (ReadCell(data, frm + sizeof(cell)) == 0) {
+      break;
+    }
+    frm = ReadCell(data, frm);
+  }
+  cell args_size = ReadCell(data, frm + 2 * sizeof(cell));
+  return frm + 3 * static_cast<cell>(sizeof(cell)) + args_size == amx->stp;
+}
+
+int CreateContext(AMX *amx) {
+  int id = next_id++;
+  if (next_id <= 0) {
+    next_id = 1;
+  }
+  Context &context = contexts[id];
+  context.amx = amx;
+  context.call = 0;
+  context.ready = false;
+  context.result = 0;
+  return id;
+}
+
+void SaveContext(AMX *amx, Context &context) {
+  unsigned char *data = GetData(amx);
+  context.cip = amx->cip;
+  context.frm = amx->frm;
+  context.stk = amx->stk;
+  context.hea = amx->hea;
+  context.alt = amx->alt;
+  context.reset_stk = amx->reset_stk;
+  context.reset_hea = amx->reset_hea;
+  auto stack = reinterpret_cast<cell *>(data + amx->stk);
+  auto heap = reinterpret_cast<cell *>(data + amx->hlw);
+  context.stack.assign(stack, stack + (amx->stp - amx->stk) / sizeof(cell));
+  context.heap.assign(heap, heap + (amx->hea - amx->hlw) / sizeof(cell));
+
+  // Leave the abstract machine as if the call had returned.
+  amx->stk = amx->stp;
+  amx->hea = amx->hlw;
+  amx->paramcount = 0;
+}
+
+void RestoreContext(AMX *amx, const Context &context) {
+  unsigned char *data = GetData(amx);
+  std::copy(context.stack.begin(), context.stack.end(),
+            reinterpret_cast<cell *>(data + context.stk));
+  std::copy(context.heap.begin(), context.heap.end(),
+            reinterpret_cast<cell *>(data + amx->hlw));
+  amx->cip = context.cip;
+  amx->frm = context.frm;
+  amx->stk = context.stk;
+  amx->hea = context.hea;
+  amx->pri = context.result;
+  amx->alt = context.alt;
+  amx->reset_stk = context.reset_stk;
+  amx->reset_hea = context.reset_hea;
+}
+
+// bool: wait_ms(milliseconds)
+bool n_wait_ms(AMX *amx, cell milliseconds) {
+  int id = SuspendScript(amx);
+  if (id == 0) {
+    return false;
+  }
+  auto delay = static_cast<std::uint64_t>(milliseconds > 0 ? milliseconds : 0);
+  sleepers.insert(std::make_pair(Now() + delay, id));
+  amx_RaiseError(amx, AMX_ERR_SLEEP);
+  return false;
+}
+
+NATIVE(wait_ms, n_wait_ms);
+
+// Records the outcome of the call if anybody waits for it; returns false if
+// nobody does.
+bool FinishCall(int call, int error, cell retval) {
+  auto iterator = call_results.find(call);
+  if (iterator == call_results.end()) {
+    return false;
+  }
+  iterator->second.finished = true;
+  iterator->second.error = error;
+  iterator->second.retval = retval;
+  return true;
+}
+
+// Saves the state of a call that amx_Exec() left suspended in the given
+// context. "call" is the id of the call if it was continued, 0 if it is new.
+void SuspendCall(AMX *amx, int id, int call, int *call_id, cell *retval) {
+  Context &context = contexts[id];
+  SaveContext(amx, context);
+  context.call = call != 0 ? call : id;
+  if (call_id != nullptr) {
+    *call_id = context.call;
+    call_results[context.call] = CallResult{false, AMX_ERR_NONE, 0};
+  }
+  if (retval != nullptr) {
+    *retval = 0;
+  }
+}
+
+} // anonymous namespace
+
+int CoroutinesCleanup(AMX *amx) {
+  for (auto iterator = contexts.begin(); iterator != contexts.end(); ) {
+    if (iterator->second.amx == amx) {
+      iterator = contexts.erase(iterator);
+    } else {
+      ++iterator;
+    }
+  }
+  running.erase(amx);
+  return AMX_ERR_NONE;
+}
+
+int ExecScript(AMX *amx, cell *retval, int index, int *call_id) {
+  if (call_id != nullptr) {
+    *call_id = 0;
+  }
+  if (running.count(amx) != 0) {
+    // Nested call: nothing can be suspended here.
+    return amx_Exec(amx, retval, index);
+  }
+  // A continued call keeps the id it got when it was first suspended.
+  int call = index == AMX_EXEC_CONT ? resumed_call : 0;
+  resumed_call = 0;
+  running[amx] = 0;
+  if (timeslice > 0) {
+    amx_SetBudget(timeslice);
+  }
+  int error = WatchedExec(amx, retval, index);
+  int id = running[amx];
+  running.erase(amx);
+
+  if (error == AMX_ERR_SLEEP && id == 0 && timeslice > 0) {
+    // Out of budget: the call can continue right away, but only after the
+    // others waiting in line. PRI is given back to it as the result.
+    id = CreateContext(amx);
+    cell pri = amx->pri;
+    SuspendCall(amx, id, call, call_id, retval);
+    ResumeScript(id, pri);
+    return AMX_ERR_NONE;
+  }
+  if (error == AMX_ERR_SLEEP && id != 0) {
+    SuspendCall(amx, id, call, call_id, retval);
+    return AMX_ERR_NONE;
+  }
+  if (id != 0) {
+    // The native asked for suspension but the call finished anyway.
+    contexts.erase(id);
+  }
+  if (call != 0
+      && FinishCall(call, error, retval != nullptr ? *retval : 0)) {
+    // The caller takes care of the error.
+    return AMX_ERR_NONE;
+  }
+  return error;
+}
+
+bool GetCallResult(int call_id, int *error, cell *retval) {
+  auto iterator = call_results.find(call_id);
+  if (iterator == call_results.end() || !iterator->second.finished) {
+    return false;
+  }
+  *error = iterator->second.error;
+  *retval = iterator->second.retval;
+  call_results.erase(iterator);
+  return true;
+}
+
+int SuspendScript(AMX *amx) {
+  auto iterator = running.find(amx);
+  if (iterator == running.end()
+      || iterator->second != 0
+      || !IsTopLevelCall(amx)) {
+    return 0;
+  }
+  int id = CreateContext(amx);
+  iterator->second = id;
+  return id;
+}
+
+void ResumeScript(int id, cell result) {
+  auto iterator = contexts.find(id);
+  if (iterator == contexts.end() || iterator->second.ready) {
+    return;
+  }
+  iterator->second.ready = true;
+  iterator->second.result = result;
+  ready_contexts.push_back(id);
+}
+
+bool HasSuspendedScripts() {
+  return !contexts.empty();
+}
+
+bool HasReadyScripts() {
+  return !ready_contexts.empty();
+}
+
+void SetTimeslice(long instructions) {
+  timeslice = instructions;
+}
+
+void ProcessCoroutines() {
+  std::uint64_t now = Now();
+  while (!sleepers.empty() && sleepers.begin()->first <= now) {
+    ResumeScript(sleepers.begin()->second, 1);
+    sleepers.erase(sleepers.begin());
+  }
+
+  // Contexts that are suspended again while they run go to the back of the
+  // queue and wait for the next call.
+  for (std::size_t n = ready_contexts.size(); n > 0; n--) {
+    int id = ready_contexts.front();
+    ready_contexts.pop_front();
+    auto iterator = contexts.find(id);
+    if (iterator == contexts.end()) {
+      continue;
+    }
+    AMX *amx = iterator->second.amx;
+    if (amx->stk != amx->stp || amx->hea != amx->hlw) {
+      // Something is still running in this AMX, try again later.
+      ready_contexts.push_back(id);
+      continue;
+    }
+    // The restored heap includes whatever the original caller allotted for
+    // the arguments; that caller has already "released" it when the call was
+    // suspended, so amx_Exec() must not bring it back when the call returns.
+    cell hea = amx->hea;
+    RestoreContext(amx, iterator->second);
+    resumed_call = iterator->second.call;
+    contexts.erase(iterator);
+
+    cell retval;
+    int error = ExecScript(amx, &retval, AMX_EXEC_CONT);
+    amx->hea = hea;
+    if (error != AMX_ERR_NONE) {
+      std::printf("Error while resuming script: %s (%d)\n",
+                  aux_StrError(error), error);
+    }
+  }
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef COROUTINES_H
+#define COROUTINES_H
+
+#include "amx/amx.h"
+
+// Suspendable script calls. A native can suspend the script that called it
+// with SuspendScript() and later continue it with ResumeScript(); in the
+// meantime the runner is free to call other publics, which may be suspended
+// as well. wait_ms() is implemented on top of this.
+//
+// A suspended call keeps its own copy of the stack and heap; the global
+// variables are shared. Only calls made through ExecScript() at the top
+// level can be suspended, not calls nested in another native or made by a
+// plugin.
+
+int CoroutinesCleanup(AMX *amx);
+
+// Same as amx_Exec(), but a call that is suspended returns AMX_ERR_NONE
+// (with a return value of 0) and continues later. If "call_id" is given, it
+// is set to an id for the suspended call (or to 0 if the call finished), to
+// get its outcome with GetCallResult() once it finishes.
+int ExecScript(AMX *amx, cell *retval, int index, int *call_id = nullptr);
+
+// Gets the error code and return value of a suspended call that has
+// finished since; returns false if it's still running.
+bool GetCallResult(int call_id, int *error, cell *retval);
+
+// Suspends the script that called the current native; the native must then
+// return after raising AMX_ERR_SLEEP. Returns 0 if the script can't be
+// suspended here.
+int SuspendScript(AMX *amx);
+
+// Lets the suspended script continue in the next ProcessCoroutines(), with
+// "result" as the return value of the native that suspended it.
+void ResumeScript(int id, cell result);
+
+bool HasSuspendedScripts();
+
+// Whether some suspended calls can continue now.
+bool HasReadyScripts();
+
+void ProcessCoroutines();
+
+// Gives top-level calls a budget of about "instructions" instructions (see
+// amx_SetBudget()) each time they run. A call that uses it up is suspended
+// as if it had called wait_ms(0): the caller gets 0 as the return value (or
+// the real outcome later from GetCallResult()) and the call continues in a
+// later ProcessCoroutines(), after the other calls that are ready. 0 turns
+// this off.
+void SetTimeslice(long instructions);
+
+#endif // !COROUTINES_H
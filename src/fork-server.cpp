@@ -0,0 +1,208 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "fork-server.h"
+#include "watchdog.h"
+#include "amx/amxaux.h"
+
+#ifndef _WIN32
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+namespace {
+
+// Don't let a client that went away kill the server with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+  const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+  const int SEND_FLAGS = 0;
+#endif
+
+bool WriteAll(int fd, const std::string &data) {
+  std::size_t offset = 0;
+  while (offset < data.length()) {
+    ssize_t size = send(fd, data.data() + offset, data.length() - offset,
+                        SEND_FLAGS);
+    if (size <= 0) {
+      return false;
+    }
+    offset += static_cast<std::size_t>(size);
+  }
+  return true;
+}
+
+// Reads the next line from the connection, without the line break. Returns
+// false at the end of the stream.
+bool ReadLine(int fd, std::string &buffer, std::string &line) {
+  for (;;) {
+    auto end = buffer.find('\n');
+    if (end != std::string::npos) {
+      line = buffer.substr(0, end);
+      buffer.erase(0, end + 1);
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      return true;
+    }
+    char data[4096];
+    ssize_t size = read(fd, data, sizeof(data));
+    if (size <= 0) {
+      return false;
+    }
+    buffer.append(data, static_cast<std::size_t>(size));
+  }
+}
+
+// Runs in the forked child: calls the public and writes the reply.
+void RunTest(AMX *amx, const std::string &name, int connection) {
+  char reply[256];
+  int index;
+  int amx_error = amx_FindPublic(amx, name.c_str(), &index);
+  if (amx_error == AMX_ERR_NONE) {
+    cell retval = 0;
+    auto start = std::chrono::steady_clock::now();
+    amx_error = WatchedExec(amx, &retval, index);
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    if (amx_error == AMX_ERR_NONE) {
+      std::snprintf(reply, sizeof(reply), "OK %s %ld %lld\n",
+                    name.c_str(), static_cast<long>(retval),
+                    static_cast<long long>(time));
+    }
+  }
+  if (amx_error != AMX_ERR_NONE) {
+    std::snprintf(reply, sizeof(reply), "FAIL %s %d %s\n",
+                  name.c_str(), amx_error, aux_StrError(amx_error));
+  }
+  std::fflush(nullptr);
+  WriteAll(connection, reply);
+}
+
+// Handles the requests of one client in turn. Returns false when asked to
+// quit.
+bool ServeConnection(AMX *amx, int connection) {
+  std::string buffer;
+  std::string name;
+  while (ReadLine(connection, buffer, name)) {
+    if (name.empty()) {
+      continue;
+    }
+    if (name == "quit") {
+      return false;
+    }
+
+    // Anything left in the stdio buffers would be written again by the
+    // child.
+    std::fflush(nullptr);
+    pid_t pid = fork();
+    if (pid < 0) {
+      WriteAll(connection, "FAIL " + name + " -1 fork() failed\n");
+      continue;
+    }
+    if (pid == 0) {
+      RestartWatchdogAfterFork();
+      RunTest(amx, name, connection);
+      _exit(0);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFSIGNALED(status)) {
+      WriteAll(connection, "CRASH " + name + " "
+                           + std::to_string(WTERMSIG(status)) + "\n");
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+      WriteAll(connection, "EXIT " + name + " "
+                           + std::to_string(WEXITSTATUS(status)) + "\n");
+    }
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+bool RunForkServer(AMX *amx, const std::string &socket_path) {
+  sockaddr_un address = {};
+  if (socket_path.length() >= sizeof(address.sun_path)) {
+    std::printf("Fork server: socket path is too long: %s\n",
+                socket_path.c_str());
+    return false;
+  }
+  address.sun_family = AF_UNIX;
+  socket_path.copy(address.sun_path, socket_path.length());
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    std::printf("Fork server: could not create socket\n");
+    return false;
+  }
+  unlink(socket_path.c_str());
+  if (bind(server, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) != 0
+      || listen(server, 16) != 0) {
+    std::printf("Fork server: could not listen on %s\n", socket_path.c_str());
+    close(server);
+    return false;
+  }
+
+  std::printf("Fork server listening on %s\n", socket_path.c_str());
+  std::fflush(nullptr);
+  for (;;) {
+    int connection = accept(server, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    bool keep_running = ServeConnection(amx, connection);
+    close(connection);
+    if (!keep_running) {
+      break;
+    }
+  }
+
+  close(server);
+  unlink(socket_path.c_str());
+  return true;
+}
+
+#else // _WIN32
+
+bool RunForkServer(AMX *amx, const std::string &socket_path) {
+  std::printf("Fork server is not supported on this system\n");
+  return false;
+}
+
+#endif // _WIN32
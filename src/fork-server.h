@@ -0,0 +1,52 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef FORK_SERVER_H
+#define FORK_SERVER_H
+
+#include <string>
+#include "amx/amx.h"
+
+// Serves test requests on a Unix domain socket. The script is loaded and
+// initialised once; every request forks a child that runs one public function
+// on a copy-on-write copy of the process and then exits, so tests can't see
+// each other's changes.
+//
+// A request is a line with the name of the public. The reply is one line:
+//
+//   OK <name> <return value> <microseconds>
+//   FAIL <name> <error code> <error message>
+//   EXIT <name> <exit code>       (the script called ExitProcess)
+//   CRASH <name> <signal number>
+//
+// A line saying "quit" stops the server. Publics are run synchronously:
+// timers, asynchronous file operations and suspended calls that have not
+// completed by the time the public returns are dropped with the child.
+//
+// Returns false if the server could not be started, for example on systems
+// without fork().
+bool RunForkServer(AMX *amx, const std::string &socket_path);
+
+#endif // !FORK_SERVER_H
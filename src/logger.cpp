@@ -0,0 +1,255 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.h"
+
+namespace {
+
+// Ring buffer capacity in messages; must be a power of two.
+const std::size_t RING_SIZE = 1024;
+// Messages longer than this are kept in a separately allocated buffer.
+const std::size_t SLOT_TEXT_SIZE = 240;
+// How long the writer thread sleeps when there is nothing to write. This is
+// also the maximum delay before a message appears.
+const std::chrono::milliseconds WRITER_IDLE_TIME{1};
+// How long a producer waits for a free slot before it drops its message.
+const std::chrono::milliseconds MAX_PUSH_WAIT{100};
+// Size of the batches written by the writer thread.
+const std::size_t BATCH_SIZE = 64 * 1024;
+
+struct Slot {
+  std::atomic<std::size_t> sequence;
+  std::size_t length;
+  char *long_text;
+  char text[SLOT_TEXT_SIZE];
+};
+
+// A bounded multi-producer queue (after Dmitry Vyukov's MPMC queue) with a
+// single consumer. Each slot's sequence number tells whether it is free for
+// the producer at a given position or ready for the consumer.
+Slot ring[RING_SIZE];
+std::atomic<std::size_t> enqueue_pos{0};
+std::size_t dequeue_pos = 0;
+
+FILE *log_file = nullptr;
+// Set once StopLog() has closed the log file; later messages are dropped
+// rather than sent to stdout.
+bool log_file_closed = false;
+// Guards log_file against StopLog() while WriteSync() is using it.
+std::mutex sync_mutex;
+
+std::thread writer;
+std::atomic<bool> async_mode{false};
+std::atomic<bool> stop_writer{false};
+
+std::atomic<unsigned long> num_blocked{0};
+std::atomic<unsigned long> num_dropped{0};
+
+FILE *GetOutput() {
+  return log_file != nullptr ? log_file : stdout;
+}
+
+void WriteSync(const char *text, std::size_t length) {
+  std::lock_guard<std::mutex> lock(sync_mutex);
+  if (log_file_closed) {
+    return;
+  }
+  std::fwrite(text, 1, length, GetOutput());
+}
+
+bool TryPush(const char *text, std::size_t length) {
+  std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &ring[pos & (RING_SIZE - 1)];
+    std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<std::intptr_t>(sequence)
+              - static_cast<std::intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // full
+    } else {
+      pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->length = length;
+  if (length <= SLOT_TEXT_SIZE) {
+    slot->long_text = nullptr;
+    std::memcpy(slot->text, text, length);
+  } else {
+    slot->long_text = new char[length];
+    std::memcpy(slot->long_text, text, length);
+  }
+  slot->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+void Push(const char *text, std::size_t length) {
+  if (TryPush(text, length)) {
+    return;
+  }
+  num_blocked++;
+  auto deadline = std::chrono::steady_clock::now() + MAX_PUSH_WAIT;
+  while (std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+    if (TryPush(text, length)) {
+      return;
+    }
+  }
+  num_dropped++;
+}
+
+// Moves all queued messages to the batch buffer, writing it out whenever it
+// fills up. Returns false if the queue was empty.
+bool Drain(std::vector<char> &batch) {
+  bool drained = false;
+  for (;;) {
+    Slot *slot = &ring[dequeue_pos & (RING_SIZE - 1)];
+    std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence != dequeue_pos + 1) {
+      break;
+    }
+    const char *text = slot->long_text != nullptr ? slot->long_text
+                                                  : slot->text;
+    if (batch.size() + slot->length > BATCH_SIZE && !batch.empty()) {
+      std::fwrite(batch.data(), 1, batch.size(), GetOutput());
+      batch.clear();
+    }
+    batch.insert(batch.end(), text, text + slot->length);
+    delete[] slot->long_text;
+    slot->sequence.store(dequeue_pos + RING_SIZE, std::memory_order_release);
+    dequeue_pos++;
+    drained = true;
+  }
+  if (!batch.empty()) {
+    std::fwrite(batch.data(), 1, batch.size(), GetOutput());
+    std::fflush(GetOutput());
+    batch.clear();
+  }
+  return drained;
+}
+
+void RunWriter() {
+  std::vector<char> batch;
+  batch.reserve(BATCH_SIZE);
+  while (!stop_writer) {
+    if (!Drain(batch)) {
+      std::this_thread::sleep_for(WRITER_IDLE_TIME);
+    }
+  }
+  // Producers that raced with StopLog() may still be finishing a push.
+  while (Drain(batch)) {
+  }
+}
+
+} // anonymous namespace
+
+bool SetLogFile(const std::string &path) {
+  FILE *file = std::fopen(path.c_str(), "a");
+  if (file == nullptr) {
+    return false;
+  }
+  log_file = file;
+  return true;
+}
+
+bool StartAsyncLog() {
+  if (async_mode) {
+    return true;
+  }
+  for (std::size_t i = 0; i < RING_SIZE; i++) {
+    ring[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  stop_writer = false;
+  writer = std::thread(RunWriter);
+  async_mode = true;
+  // Make sure nothing is lost if a script calls ExitProcess().
+  std::atexit(StopLog);
+  return true;
+}
+
+void StopLog() {
+  if (async_mode.exchange(false)) {
+    stop_writer = true;
+    writer.join();
+    if (num_blocked > 0 || num_dropped > 0) {
+      std::fprintf(stderr,
+                   "Log: %lu messages blocked, %lu messages dropped\n",
+                   num_blocked.load(), num_dropped.load());
+    }
+  }
+  // Plugin threads may still be logging, e.g. when a script calls
+  // ExitProcess().
+  std::lock_guard<std::mutex> lock(sync_mutex);
+  if (log_file != nullptr) {
+    std::fclose(log_file);
+    log_file = nullptr;
+    log_file_closed = true;
+  }
+}
+
+void LogVPrintf(const char *format, va_list args) {
+  static thread_local char buffer[SLOT_TEXT_SIZE];
+
+  // Format straight into the thread's buffer and only fall back to the heap
+  // for long messages.
+  va_list args_copy;
+  va_copy(args_copy, args);
+  int length = std::vsnprintf(buffer, sizeof(buffer), format, args_copy);
+  va_end(args_copy);
+  if (length < 0) {
+    return;
+  }
+
+  char *text = buffer;
+  std::vector<char> long_text;
+  if (static_cast<std::size_t>(length) + 1 >= sizeof(buffer)) {
+    long_text.resize(length + 2);
+    std::vsnprintf(long_text.data(), long_text.size(), format, args);
+    text = long_text.data();
+  }
+  text[length++] = '\n';
+
+  if (async_mode) {
+    Push(text, length);
+  } else {
+    WriteSync(text, length);
+  }
+}
@@ -0,0 +1,310 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <cstddef>
+#include <initializer_list>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "amx/amx.h"
+
+// Typed native functions. A native is written as an ordinary function whose
+// first parameter is the AMX and whose other parameters have one of these
+// types:
+//
+//   cell, int, bool, float  value
+//   cell *, const cell *    array or reference, as a pointer into the AMX
+//   String                  string, left in place in the AMX
+//   VarArgs                 the remaining arguments (must be last)
+//
+// and is registered under its Pawn name with the NATIVE() macro:
+//
+//   cell n_MyNative(AMX *amx, cell value, const cell *array, String name) {
+//     ...
+//   }
+//   NATIVE(MyNative, n_MyNative);
+//
+// The generated wrapper checks the argument count and the addresses before
+// calling the function, so the function itself needn't. Arguments are
+// converted in place; nothing is copied or allocated.
+
+namespace native {
+
+// A string argument: the address in the AMX and the cells at that address.
+class String {
+ public:
+  String(cell amx_addr, cell *cstr): amx_addr_(amx_addr), cstr_(cstr) {}
+
+  cell amx_addr() const { return amx_addr_; }
+  cell *cells() const { return cstr_; }
+
+  bool IsPacked() const {
+    return static_cast<ucell>(*cstr_) > UNPACKEDMAX;
+  }
+
+  int Length() const {
+    int length;
+    amx_StrLen(cstr_, &length);
+    return length;
+  }
+
+  // Copies the string to a buffer of the given size; the result is always
+  // zero-terminated.
+  void Get(char *dest, std::size_t size) const {
+    amx_GetString(dest, cstr_, 0, size);
+  }
+
+ private:
+  cell amx_addr_;
+  cell *cstr_;
+};
+
+// Variable arguments, passed by reference.
+class VarArgs {
+ public:
+  VarArgs(AMX *amx, const cell *args, int count)
+    : amx_(amx), args_(args), count_(count) {}
+
+  int count() const { return count_; }
+  cell address(int index) const { return args_[index]; }
+
+  // Returns the address of the argument's value, or nullptr if it is
+  // invalid.
+  cell *Get(int index) const {
+    cell *cptr;
+    if (amx_GetAddr(amx_, args_[index], &cptr) != AMX_ERR_NONE) {
+      return nullptr;
+    }
+    return cptr;
+  }
+
+ private:
+  AMX *amx_;
+  const cell *args_;
+  int count_;
+};
+
+namespace internal {
+
+template <typename T>
+struct Param;
+
+template <>
+struct Param<cell> {
+  static const int kCells = 1;
+  static cell Get(AMX *, const cell *params, int index) {
+    return params[index];
+  }
+  static bool IsValid(cell) { return true; }
+};
+
+template <>
+struct Param<bool> {
+  static const int kCells = 1;
+  static bool Get(AMX *, const cell *params, int index) {
+    return params[index] != 0;
+  }
+  static bool IsValid(bool) { return true; }
+};
+
+template <>
+struct Param<float> {
+  static const int kCells = 1;
+  static float Get(AMX *, const cell *params, int index) {
+    return amx_ctof(params[index]);
+  }
+  static bool IsValid(float) { return true; }
+};
+
+template <>
+struct Param<cell *> {
+  static const int kCells = 1;
+  static cell *Get(AMX *amx, const cell *params, int index) {
+    cell *cptr;
+    if (amx_GetAddr(amx, params[index], &cptr) != AMX_ERR_NONE) {
+      return nullptr;
+    }
+    return cptr;
+  }
+  static bool IsValid(const cell *cptr) { return cptr != nullptr; }
+};
+
+template <>
+struct Param<const cell *> : Param<cell *> {};
+
+template <>
+struct Param<String> {
+  static const int kCells = 1;
+  static String Get(AMX *amx, const cell *params, int index) {
+    return String(params[index], Param<cell *>::Get(amx, params, index));
+  }
+  static bool IsValid(const String &s) { return s.cells() != nullptr; }
+};
+
+template <>
+struct Param<VarArgs> {
+  static const int kCells = 0;
+  static VarArgs Get(AMX *amx, const cell *params, int index) {
+    int count = static_cast<int>(params[0] / sizeof(cell)) - index + 1;
+    return VarArgs(amx, params + index, count);
+  }
+  static bool IsValid(const VarArgs &) { return true; }
+};
+
+template <typename T>
+struct Result {
+  static cell ToCell(T value) { return static_cast<cell>(value); }
+};
+
+template <>
+struct Result<float> {
+  static cell ToCell(float value) { return amx_ftoc(value); }
+};
+
+template <int... I>
+struct Indices {};
+
+template <int N, int... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+
+template <int... I>
+struct MakeIndices<0, I...> {
+  typedef Indices<I...> Type;
+};
+
+template <typename... Args>
+struct Count;
+
+template <>
+struct Count<> {
+  static const int kCells = 0;
+};
+
+template <typename T, typename... Args>
+struct Count<T, Args...> {
+  static const int kCells =
+    Param<typename std::decay<T>::type>::kCells + Count<Args...>::kCells;
+};
+
+inline bool AllValid(std::initializer_list<bool> list) {
+  for (bool valid : list) {
+    if (!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename T>
+struct Wrapper;
+
+template <typename R, typename... Args>
+struct Wrapper<R (*)(AMX *, Args...)> {
+  template <R (*F)(AMX *, Args...)>
+  static cell AMX_NATIVE_CALL Call(AMX *amx, const cell *params) {
+    if (params[0] < static_cast<cell>(Count<Args...>::kCells * sizeof(cell))) {
+      amx_RaiseError(amx, AMX_ERR_PARAMS);
+      return 0;
+    }
+    return Invoke<F>(amx, params,
+                     typename MakeIndices<sizeof...(Args)>::Type());
+  }
+
+  template <R (*F)(AMX *, Args...), int... I>
+  static cell Invoke(AMX *amx, const cell *params, Indices<I...>) {
+    std::tuple<typename std::decay<Args>::type...> args{
+      Param<typename std::decay<Args>::type>::Get(amx, params, I + 1)...
+    };
+    if (!AllValid({Param<typename std::decay<Args>::type>::IsValid(
+                    std::get<I>(args))...})) {
+      amx_RaiseError(amx, AMX_ERR_NATIVE);
+      return 0;
+    }
+    return Result<R>::ToCell(F(amx, std::get<I>(args)...));
+  }
+};
+
+template <typename... Args>
+struct Wrapper<void (*)(AMX *, Args...)> {
+  template <void (*F)(AMX *, Args...)>
+  static cell AMX_NATIVE_CALL Call(AMX *amx, const cell *params) {
+    if (params[0] < static_cast<cell>(Count<Args...>::kCells * sizeof(cell))) {
+      amx_RaiseError(amx, AMX_ERR_PARAMS);
+      return 0;
+    }
+    return Invoke<F>(amx, params,
+                     typename MakeIndices<sizeof...(Args)>::Type());
+  }
+
+  template <void (*F)(AMX *, Args...), int... I>
+  static cell Invoke(AMX *amx, const cell *params, Indices<I...>) {
+    std::tuple<typename std::decay<Args>::type...> args{
+      Param<typename std::decay<Args>::type>::Get(amx, params, I + 1)...
+    };
+    if (!AllValid({Param<typename std::decay<Args>::type>::IsValid(
+                    std::get<I>(args))...})) {
+      amx_RaiseError(amx, AMX_ERR_NATIVE);
+      return 0;
+    }
+    F(amx, std::get<I>(args)...);
+    return 0;
+  }
+};
+
+inline std::vector<AMX_NATIVE_INFO> &GetNatives() {
+  static std::vector<AMX_NATIVE_INFO> natives;
+  return natives;
+}
+
+struct Registrar {
+  Registrar(const char *name, AMX_NATIVE func) {
+    AMX_NATIVE_INFO info = {name, func};
+    GetNatives().push_back(info);
+  }
+};
+
+} // namespace internal
+
+// Registers all natives defined with NATIVE() in this program.
+inline int RegisterNatives(AMX *amx) {
+  const auto &natives = internal::GetNatives();
+  return amx_Register(amx, natives.data(), static_cast<int>(natives.size()));
+}
+
+} // namespace native
+
+// The wrapper of a typed native, usable as an AMX_NATIVE.
+#define NATIVE_WRAPPER(func) \
+  (::native::internal::Wrapper<decltype(&func)>::template Call<&func>)
+
+// Defines the native "name", implemented by the typed function "func".
+#define NATIVE(name, func) \
+  static ::native::internal::Registrar name##_registrar(#name, \
+                                                        NATIVE_WRAPPER(func))
+
+#endif // !NATIVE_H
@@ -0,0 +1,286 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "native.h"
+#include "parallel.h"
+
+namespace {
+
+// Set in worker threads; scripts running there can't start another
+// parallel_for().
+thread_local bool is_worker = false;
+
+// The number of chunks per worker that a range is split into; more chunks
+// balance uneven work better.
+const cell CHUNKS_PER_WORKER = 8;
+
+struct Job {
+  int index;
+  cell start;
+  cell end;
+  std::vector<cell> args; // args[0] is replaced with the loop index
+  cell *results;
+  cell chunk_size;
+  std::atomic<cell> next;
+  std::atomic<int> error;
+};
+
+class WorkerPool {
+ public:
+  WorkerPool(AMX *source, int num_workers)
+    : source_(source),
+      job_(nullptr),
+      generation_(0),
+      num_busy_(0),
+      stop_(false) {
+    for (int i = 0; i < num_workers; i++) {
+      std::unique_ptr<Worker> worker(new Worker);
+      if (!worker->Init(source)) {
+        break;
+      }
+      workers_.push_back(std::move(worker));
+    }
+    for (auto &worker : workers_) {
+      worker->thread = std::thread(&WorkerPool::Run, this, worker.get());
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_cond_.notify_all();
+    for (auto &worker : workers_) {
+      worker->thread.join();
+    }
+  }
+
+  bool IsEmpty() const { return workers_.empty(); }
+
+  std::size_t GetNumWorkers() const { return workers_.size(); }
+
+  // Runs the job on all workers and waits until the range is done.
+  void Execute(Job &job) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = &job;
+    generation_++;
+    num_busy_ = workers_.size();
+    start_cond_.notify_all();
+    done_cond_.wait(lock, [this] { return num_busy_ == 0; });
+    job_ = nullptr;
+  }
+
+ private:
+  struct Worker {
+    Worker(): data(nullptr) {
+      std::memset(&amx, 0, sizeof(amx));
+    }
+
+    ~Worker() {
+      std::free(data);
+    }
+
+    bool Init(AMX *source) {
+      auto hdr = reinterpret_cast<AMX_HEADER *>(source->base);
+      data = static_cast<unsigned char *>(std::malloc(hdr->stp - hdr->dat));
+      if (data == nullptr) {
+        return false;
+      }
+      if (amx_Clone(&amx, source, data) != AMX_ERR_NONE) {
+        return false;
+      }
+      // Don't let the workers patch SYSREQ instructions in the shared code
+      // while other workers execute it.
+      amx.sysreq_d = 0;
+      return true;
+    }
+
+    AMX amx;
+    unsigned char *data;
+    std::thread thread;
+  };
+
+  void Run(Worker *worker) {
+    is_worker = true;
+    unsigned long generation = 0;
+    std::vector<cell> args;
+    for (;;) {
+      Job *job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cond_.wait(lock, [this, generation] {
+          return stop_ || generation_ != generation;
+        });
+        if (stop_) {
+          return;
+        }
+        generation = generation_;
+        job = job_;
+      }
+
+      // The calling instance is blocked in parallel_for(), so its global
+      // variables can be read safely.
+      auto hdr = reinterpret_cast<AMX_HEADER *>(source_->base);
+      unsigned char *source_data = source_->data != nullptr
+        ? source_->data
+        : source_->base + hdr->dat;
+      std::memcpy(worker->data, source_data, hdr->hea - hdr->dat);
+
+      args = job->args;
+      for (;;) {
+        cell first = job->next.fetch_add(job->chunk_size);
+        if (first >= job->end) {
+          break;
+        }
+        cell last = std::min(first + job->chunk_size, job->end);
+        for (cell i = first; i < last; i++) {
+          args[0] = i;
+          cell retval = 0;
+          int error = amx_PushArgs(&worker->amx, args.data(),
+                                   static_cast<int>(args.size()));
+          if (error == AMX_ERR_NONE) {
+            error = amx_Exec(&worker->amx, &retval, job->index);
+          }
+          if (error != AMX_ERR_NONE) {
+            int none = AMX_ERR_NONE;
+            job->error.compare_exchange_strong(none, error);
+            job->next = job->end;
+            break;
+          }
+          if (job->results != nullptr) {
+            job->results[i - job->start] = retval;
+          }
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--num_busy_ == 0) {
+        done_cond_.notify_one();
+      }
+    }
+  }
+
+  AMX *source_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_cond_;
+  std::condition_variable done_cond_;
+  Job *job_;
+  unsigned long generation_;
+  std::size_t num_busy_;
+  bool stop_;
+};
+
+std::unordered_map<AMX *, std::unique_ptr<WorkerPool>> pools;
+
+WorkerPool *GetPool(AMX *amx) {
+  auto &pool = pools[amx];
+  if (pool == nullptr) {
+    int num_workers = static_cast<int>(std::thread::hardware_concurrency());
+    pool.reset(new WorkerPool(amx, std::max(num_workers, 1)));
+  }
+  return pool->IsEmpty() ? nullptr : pool.get();
+}
+
+// bool: parallel_for(const function[], start, end, results[] = {0},
+//                    size = sizeof results, {Float, _}: ...)
+bool n_parallel_for(AMX *amx,
+                    native::String function,
+                    cell start,
+                    cell end,
+                    cell *results,
+                    cell size,
+                    native::VarArgs var_args) {
+  if (is_worker || end < start) {
+    return false;
+  }
+
+  char name[sNAMEMAX + 1];
+  int length = function.Length();
+  if (length == 0 || length > sNAMEMAX) {
+    return false;
+  }
+  function.Get(name, sizeof(name));
+
+  Job job;
+  if (amx_FindPublic(amx, name, &job.index) != AMX_ERR_NONE) {
+    return false;
+  }
+  if (end == start) {
+    return true;
+  }
+
+  // The default one-cell array means that no results are wanted.
+  job.results = nullptr;
+  if (size >= end - start) {
+    job.results = results;
+  } else if (size > 1) {
+    return false;
+  }
+
+  // Extra arguments are passed to the function by value, after the index.
+  job.args.push_back(0);
+  for (int i = 0; i < var_args.count(); i++) {
+    cell *value = var_args.Get(i);
+    if (value == nullptr) {
+      return false;
+    }
+    job.args.push_back(*value);
+  }
+
+  WorkerPool *pool = GetPool(amx);
+  if (pool == nullptr) {
+    return false;
+  }
+  cell num_chunks =
+    static_cast<cell>(pool->GetNumWorkers()) * CHUNKS_PER_WORKER;
+  job.start = start;
+  job.end = end;
+  job.chunk_size = std::max<cell>((end - start) / num_chunks, 1);
+  job.next = start;
+  job.error = AMX_ERR_NONE;
+  pool->Execute(job);
+  return job.error == AMX_ERR_NONE;
+}
+
+NATIVE(parallel_for, n_parallel_for);
+
+} // anonymous namespace
+
+int ParallelCleanup(AMX *amx) {
+  pools.erase(amx);
+  return AMX_ERR_NONE;
+}
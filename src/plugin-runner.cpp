@@ -26,20 +26,38 @@
 #include <atomic>
 #include <chrono>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <list>
 #include <new>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
+#include <iterator>
+#include "async-file.h"
+#include "bench.h"
+#include "coroutines.h"
+#include "fork-server.h"
+#include "logger.h"
+#include "native.h"
+#include "parallel.h"
 #include "plugin.h"
 #include "plugincommon.h"
+#include "profiler.h"
+#include "shards.h"
+#include "snapshot.h"
+#include "timers.h"
+#include "watchdog.h"
 #include "amx/amx.h"
 #include "amx/amxaux.h"
 
 extern "C" {
+  int AMXEXPORT amx_ConsoleBuffer(int lineflush);
+  int AMXEXPORT amx_ConsoleFlush(void);
   int AMXEXPORT amx_ConsoleInit(AMX *amx);
   int AMXEXPORT amx_ConsoleCleanup(AMX *amx);
   int AMXEXPORT amx_CoreInit(AMX *amx);
@@ -58,7 +76,7 @@ namespace {
 
 void logprintf(const char *format, ...);
 
-const void *amx_functions[] = {
+void *amx_functions[] = {
   (void *)amx_Align16,
   (void *)amx_Align32,
   nullptr,
@@ -102,7 +120,10 @@ const void *amx_functions[] = {
   (void *)amx_UTF8Check,
   (void *)amx_UTF8Get,
   (void *)amx_UTF8Len,
-  (void *)amx_UTF8Put
+  (void *)amx_UTF8Put,
+  (void *)amx_PushArgs,
+  (void *)amx_PrepareCall,
+  (void *)amx_ExecCall
 };
 
 void *plugin_data[] {
@@ -137,8 +158,7 @@ std::atomic<bool> process_ticks{false};
 void logprintf(const char *format, ...) {
   va_list args;
   va_start(args, format);
-  vprintf(format, args);
-  printf("\n");
+  LogVPrintf(format, args);
   va_end(args);
 }
 
@@ -182,68 +202,171 @@ Plugin *LoadPlugin(std::string path) {
   return nullptr;
 }
 
-cell AMX_NATIVE_CALL n_ExitProcess(AMX *amx, const cell *params) {
-  std::exit(params[1]);
-  return 0;
+// ExitProcess(exit_code)
+void n_ExitProcess(AMX *amx, cell exit_code) {
+  std::exit(exit_code);
 }
 
-cell AMX_NATIVE_CALL n_CallLocalFunction(AMX *amx, const cell *params) {
-  char *function_name;
-  amx_StrParam(amx, params[1], function_name);
+NATIVE(ExitProcess, n_ExitProcess);
 
+// The longest public name that can be looked up; the compiler limits names
+// to 31 characters.
+const int MAX_PUBLIC_NAME = 63;
+// The compiler does not allow more arguments than this in one call.
+const int MAX_CALL_ARGS = 64;
+
+struct CachedPublic {
+  char name[MAX_PUBLIC_NAME + 1];
+  int index;
+};
+
+// Public indexes found by CallLocalFunction(), keyed by the address of the
+// name string; the name is compared on every hit in case the string at that
+// address has changed.
+std::unordered_map<AMX *, std::unordered_map<cell, CachedPublic>>
+  public_cache;
+
+bool FindPublicCached(AMX *amx, const native::String &name, int &index) {
+  int length = name.Length();
+  if (length == 0 || length > MAX_PUBLIC_NAME) {
+    return false;
+  }
+  char name_chars[MAX_PUBLIC_NAME + 1];
+  name.Get(name_chars, sizeof(name_chars));
+
+  auto &cache = public_cache[amx];
+  auto iterator = cache.find(name.amx_addr());
+  if (iterator != cache.end()
+      && std::strcmp(iterator->second.name, name_chars) == 0) {
+    index = iterator->second.index;
+    return true;
+  }
+  if (amx_FindPublic(amx, name_chars, &index) != AMX_ERR_NONE) {
+    return false;
+  }
+  CachedPublic &entry = cache[name.amx_addr()];
+  std::memcpy(entry.name, name_chars, length + 1);
+  entry.index = index;
+  return true;
+}
+
+// CallLocalFunction(const function[], const format[], {Float, _}: ...)
+//
+// Format specifiers:
+//   b, c, d, f, i, x  value
+//   s                 string, copied
+//   a                 array, copied; must be followed by its size ("ai")
+//   v                 variable, passed by reference
+cell n_CallLocalFunction(AMX *amx,
+                         native::String function,
+                         native::String format_string,
+                         native::VarArgs var_args) {
   int function_index;
-  if (amx_FindPublic(amx, function_name, &function_index) != AMX_ERR_NONE) {
+  if (!FindPublicCached(amx, function, function_index)) {
     return 0;
   }
 
-  char *format;
-  amx_StrParam(amx, params[2], format);
-
-  cell num_args = params[0] / sizeof(cell);
-  std::vector<cell> pushed_strings;
-
-  if (format != nullptr) {
-    std::size_t format_length = std::strlen(format);
-    cell arg_index = 2;
-    for (std::size_t i = 0;
-         i < format_length && arg_index < num_args;
-         i++, arg_index++) {
-      cell value = params[arg_index + 1];
-      switch (format[i]) {
-        case 'd':
-        case 'i':
-        case 'f':
-          amx_Push(amx, value);
-          break;
-        case 's': {
-          char *s;
-          amx_StrParam(amx, value, s);
-          cell amx_addr;
-          cell *phys_addr;
-          if (amx_PushString(amx,
-                             &amx_addr,
-                             &phys_addr,
-                             s,
-                             false,
-                             false) == AMX_ERR_NONE) {
-            pushed_strings.push_back(amx_addr);
-          }
-          break;
+  char format[MAX_CALL_ARGS + 1];
+  format_string.Get(format, sizeof(format));
+
+  int num_args = var_args.count();
+  cell args[MAX_CALL_ARGS];
+  cell heap_addr = -1;
+  bool failed = false;
+  int count = 0;
+  for (; format[count] != '\0' && count < num_args; count++) {
+    cell *value = var_args.Get(count);
+    if (value == nullptr) {
+      failed = true;
+      break;
+    }
+    cell size;
+    switch (format[count]) {
+      case 'b':
+      case 'c':
+      case 'd':
+      case 'f':
+      case 'i':
+      case 'x':
+        args[count] = *value;
+        continue;
+      case 'v':
+        args[count] = var_args.address(count);
+        continue;
+      case 's': {
+        int length;
+        amx_StrLen(value, &length);
+        if (static_cast<ucell>(*value) > UNPACKEDMAX) {
+          size = (length + sizeof(cell)) / sizeof(cell);
+        } else {
+          size = length + 1;
         }
+        break;
       }
+      case 'a': {
+        cell *size_ptr = nullptr;
+        if (count + 1 < num_args
+            && (format[count + 1] == 'd' || format[count + 1] == 'i')) {
+          size_ptr = var_args.Get(count + 1);
+        }
+        if (size_ptr == nullptr || *size_ptr <= 0) {
+          size = 0;
+        } else {
+          size = *size_ptr;
+        }
+        break;
+      }
+      default:
+        size = 0;
+        break;
     }
-  }
 
-  cell retval = 0;
-  amx_Exec(amx, &retval, function_index);
+    // Copy the string or array to the heap, the called function gets its
+    // own copy just like with a normal function call. The size comes from
+    // the script, so the copy must not run past the end of its memory.
+    cell amx_addr;
+    cell *phys_addr;
+    if (size <= 0
+        || size > (amx->stp - var_args.address(count))
+                  / static_cast<cell>(sizeof(cell))
+        || amx_Allot(amx, size, &amx_addr, &phys_addr) != AMX_ERR_NONE) {
+      failed = true;
+      break;
+    }
+    std::memcpy(phys_addr, value, size * sizeof(cell));
+    if (heap_addr == -1) {
+      heap_addr = amx_addr;
+    }
+    args[count] = amx_addr;
+  }
 
-  for (std::size_t i = pushed_strings.size(); i > 0; i--) {
-    amx_Release(amx, pushed_strings[i - 1]);
+  // Don't call the function with some of its arguments missing.
+  if (failed) {
+    if (heap_addr != -1) {
+      amx_Release(amx, heap_addr);
+    }
+    amx_RaiseError(amx, AMX_ERR_NATIVE);
+    return 0;
   }
 
+  cell retval = 0;
+  int error = amx_PushArgs(amx, args, count);
+  if (error == AMX_ERR_NONE) {
+    error = amx_Exec(amx, &retval, function_index);
+  }
+  if (heap_addr != -1) {
+    amx_Release(amx, heap_addr);
+  }
+  if (error != AMX_ERR_NONE) {
+    // Pass the error on to the caller rather than return a bogus 0.
+    amx_RaiseError(amx, error);
+    return 0;
+  }
   return retval;
 }
 
+NATIVE(CallLocalFunction, n_CallLocalFunction);
+
 bool CheckAmxNatives(AMX *amx) {
   bool result = true;
   AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
@@ -264,6 +387,18 @@ bool CheckAmxNatives(AMX *amx) {
   return result;
 }
 
+void InitScript(AMX *amx) {
+  amx_CoreInit(amx);
+  amx_ConsoleInit(amx);
+  amx_FloatInit(amx);
+  amx_StringInit(amx);
+  amx_FileInit(amx);
+  AsyncFileInit(amx);
+  TimersInit(amx);
+
+  native::RegisterNatives(amx);
+}
+
 bool LoadScript(AMX *amx, std::string amx_path) {
   auto amx_error = aux_LoadProgram(amx, amx_path.c_str(), nullptr);
   if (amx_error != AMX_ERR_NONE) {
@@ -273,25 +408,30 @@ bool LoadScript(AMX *amx, std::string amx_path) {
   }
 
   std::printf("Loaded script: %s\n", amx_path.c_str());
-  amx_CoreInit(amx);
-  amx_ConsoleInit(amx);
-  amx_FloatInit(amx);
-  amx_StringInit(amx);
-  amx_FileInit(amx);
-
-  static const AMX_NATIVE_INFO natives[] = {
-    "ExitProcess", n_ExitProcess,
-    "CallLocalFunction", n_CallLocalFunction
-  };
-  int num_natives = static_cast<int>(sizeof(natives) / sizeof(natives[0]));
-  amx_Register(amx, natives, num_natives);
+  InitScript(amx);
+  return true;
+}
 
+// Creates another instance of a loaded script. The instance shares the code
+// with the original and gets its own data, stack and heap.
+bool CloneScript(AMX *amx, AMX *source) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(source->base);
+  void *data = std::malloc(hdr->stp - hdr->dat);
+  if (data == nullptr) {
+    return false;
+  }
+  std::memset(amx, 0, sizeof(*amx));
+  if (amx_Clone(amx, source, data) != AMX_ERR_NONE) {
+    std::free(data);
+    return false;
+  }
+  InitScript(amx);
   return true;
 }
 
-int RunScriptMain(AMX *amx) {
-  cell retval = 0;
-  int amx_error = amx_Exec(amx, &retval, AMX_EXEC_MAIN);
+// Returns the exit status for the outcome of main: its return value, or -1
+// on error.
+int GetMainStatus(int amx_error, cell retval) {
   if (amx_error != AMX_ERR_NONE) {
     std::printf("Error while executing main: %s (%d)\n",
                 aux_StrError(amx_error), amx_error);
@@ -300,32 +440,294 @@ int RunScriptMain(AMX *amx) {
   return retval;
 }
 
+// Runs main and returns its return value, or -1 on error; "completed" tells
+// whether main ran to the end without an error. If main was suspended,
+// "call_id" is set to the id of the call (see ExecScript()) and the return
+// value is meaningless; the real one comes once the call finishes.
+int RunScriptMain(AMX *amx, bool *completed = nullptr, int *call_id = nullptr) {
+  cell retval = 0;
+  int amx_error = ExecScript(amx, &retval, AMX_EXEC_MAIN, call_id);
+  if (completed != nullptr) {
+    *completed = amx_error == AMX_ERR_NONE && !HasSuspendedScripts();
+  }
+  return GetMainStatus(amx_error, retval);
+}
+
+// Takes the exit status from the suspended calls to main that have finished
+// since the last time.
+void CollectMainStatus(std::vector<int> &main_calls, int &exit_status) {
+  for (auto call_id = main_calls.begin(); call_id != main_calls.end(); ) {
+    int amx_error;
+    cell retval;
+    if (!GetCallResult(*call_id, &amx_error, &retval)) {
+      ++call_id;
+      continue;
+    }
+    int status = GetMainStatus(amx_error, retval);
+    if (exit_status == EXIT_SUCCESS) {
+      exit_status = status;
+    }
+    call_id = main_calls.erase(call_id);
+  }
+}
+
+// Runs every public whose name starts with "prefix", each from the state the
+// script was in after main(). A test fails if it raises a run-time error.
+// With more than one shard only every "num_shards"-th test is run, starting
+// from the test number "shard". Returns the number of failed tests.
+int RunTests(AMX *amx, const std::string &prefix,
+             int shard = 0, int num_shards = 1) {
+  Snapshot snapshot;
+  snapshot.Take(amx);
+
+  int num_publics = 0;
+  amx_NumPublics(amx, &num_publics);
+  int num_matches = 0;
+  int num_tests = 0;
+  int num_failed = 0;
+  for (int i = 0; i < num_publics; i++) {
+    char name[sNAMEMAX + 1];
+    if (amx_GetPublic(amx, i, name) != AMX_ERR_NONE
+        || std::strncmp(name, prefix.c_str(), prefix.length()) != 0
+        || num_matches++ % num_shards != shard) {
+      continue;
+    }
+    if (num_tests++ > 0) {
+      snapshot.Restore(amx);
+    }
+    auto start = std::chrono::steady_clock::now();
+    int amx_error = WatchedExec(amx, nullptr, i);
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    if (amx_error == AMX_ERR_NONE) {
+      std::printf("[ OK ] %s (%.3f ms)\n", name, time / 1000.0);
+    } else {
+      std::printf("[FAIL] %s: %s (%d)\n",
+                  name, aux_StrError(amx_error), amx_error);
+      num_failed++;
+    }
+  }
+  if (num_tests > 0) {
+    snapshot.Restore(amx);
+  }
+  std::printf("%d tests, %d failed\n", num_tests, num_failed);
+  return num_failed;
+}
+
 void UnloadScript(AMX *amx) {
   amx_CoreCleanup(amx);
   amx_ConsoleCleanup(amx);
   amx_FloatCleanup(amx);
   amx_StringCleanup(amx);
   amx_FileCleanup(amx);
+  AsyncFileCleanup(amx);
+  TimersCleanup(amx);
+  CoroutinesCleanup(amx);
+  ParallelCleanup(amx);
+  public_cache.erase(amx);
+}
+
+void PrintMemoryUsage(AMX *amx, std::size_t num_instances) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  long code_size = hdr->dat;
+  long data_size = hdr->hea - hdr->dat;
+  long stack_heap_size = hdr->stp - hdr->hea;
+  long instance_size = data_size + stack_heap_size;
+  long total = code_size + instance_size * static_cast<long>(num_instances);
+  std::printf("Running %lu instances: %ld bytes of shared code, "
+              "%ld bytes per instance (data %ld, stack/heap %ld); "
+              "total %ld bytes, %ld bytes saved\n",
+              static_cast<unsigned long>(num_instances),
+              code_size, instance_size, data_size, stack_heap_size,
+              total,
+              code_size * static_cast<long>(num_instances - 1));
+}
+
+// Hashes the contents of a file with FNV-1a, continuing from "hash".
+std::uint64_t HashFile(const std::string &path, std::uint64_t hash) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return hash;
+  }
+  unsigned char buffer[65536];
+  std::size_t size;
+  while ((size = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    for (std::size_t i = 0; i < size; i++) {
+      hash = (hash ^ buffer[i]) * 0x100000001b3ULL;
+    }
+  }
+  std::fclose(file);
+  return hash;
+}
+
+// Identifies the script and the set of plugins a warm start snapshot was
+// taken with; the snapshot is only valid if neither has changed.
+std::uint64_t GetWarmStartKey(const std::string &amx_path,
+                              const std::list<Plugin *> &plugins) {
+  std::uint64_t hash = HashFile(amx_path, 0xcbf29ce484222325ULL);
+  for (auto &plugin : plugins) {
+    hash = HashFile(plugin->GetPath(), hash);
+  }
+  return hash;
+}
+
+// Returns the value of the config option with the given name, or an empty
+// string if it's not set.
+std::string GetConfigOption(int optc, char **optv, const std::string &name) {
+  for (int i = 0; i < optc; i++) {
+    std::string option = optv[i];
+    if (option.compare(0, name.length(), name) == 0
+        && option.length() > name.length()
+        && option[name.length()] == ' ') {
+      return option.substr(name.length() + 1);
+    }
+  }
+  return "";
 }
 
 bool GenerateConfig(int optc, char **optv) {
   // Generate a new `server.cfg` file with the given options in, one per line.
   // This is because some plugins load the file and read from it.  It's easier
   // to just create the file than to hook all the possible file load methods.
+  //
+  // Test shards all write the same file; leave it alone if it's up to date so
+  // that one worker doesn't truncate it while a plugin in another reads it.
+  std::string config;
+  for (int i = 0; i < optc; i++) {
+    config.append(optv[i]).append("\n");
+  }
+  std::ifstream current("server.cfg");
+  if (current.is_open()
+      && std::string(std::istreambuf_iterator<char>(current),
+                     std::istreambuf_iterator<char>()) == config) {
+    return true;
+  }
+  current.close();
   std::ofstream stream("server.cfg", std::ofstream::trunc | std::ofstream::out);
   if (!stream.is_open()) {
     return false;
   }
-  for (int i = 0; i < optc; i++) {
-    stream << optv[i] << std::endl;
-  }
+  stream << config;
   stream.close();
   return true;
 }
 
+// Runner options, given before the plugin and script paths.
+struct Options {
+  std::string log_file;
+  bool async_log = false;
+  bool line_flush = false;
+  int instances = 1;
+  std::string test_prefix;
+  std::string warm_start;
+  std::string fork_server;
+  int jobs = 1;
+  int shard = 0;
+  int num_shards = 1;
+  BenchOptions bench;
+  bool profile = false;
+  std::string profile_path;
+  std::string long_call_time;
+  bool long_call_abort = false;
+  long timeslice = 0;
+};
+
+// Parses a shard number and the number of shards given as "<i>/<n>".
+bool ParseShard(const std::string &value, Options &options) {
+  int shard;
+  int num_shards;
+  if (std::sscanf(value.c_str(), "%d/%d", &shard, &num_shards) != 2
+      || shard < 0
+      || shard >= num_shards) {
+    return false;
+  }
+  options.shard = shard;
+  options.num_shards = num_shards;
+  return true;
+}
+
+// Parses leading `--name[=value]` arguments and returns the index of the
+// first non-option argument, or -1 on error.
+int ParseOptions(int argc, char **argv, Options &options) {
+  int i = 1;
+  for (; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0 || arg == "--") {
+      break;
+    }
+    std::string name = arg.substr(2);
+    std::string value;
+    auto equals = name.find('=');
+    if (equals != std::string::npos) {
+      value = name.substr(equals + 1);
+      name.erase(equals);
+    }
+    if (name == "log-file" && !value.empty()) {
+      options.log_file = value;
+    } else if (name == "async-log") {
+      options.async_log = true;
+    } else if (name == "line-flush") {
+      options.line_flush = true;
+    } else if (name == "instances" && std::atoi(value.c_str()) > 0) {
+      options.instances = std::atoi(value.c_str());
+    } else if (name == "warm-start" && !value.empty()) {
+      options.warm_start = value;
+    } else if (name == "fork-server" && !value.empty()) {
+      options.fork_server = value;
+    } else if (name == "jobs" && std::atoi(value.c_str()) > 0) {
+      options.jobs = std::atoi(value.c_str());
+    } else if (name == "shard" && ParseShard(value, options)) {
+      // Parsed by ParseShard().
+    } else if (name == "bench") {
+      options.bench.prefix = value.empty() ? "Bench_" : value;
+    } else if (name == "bench-json" && !value.empty()) {
+      options.bench.json_path = value;
+    } else if (name == "bench-baseline" && !value.empty()) {
+      options.bench.baseline_path = value;
+    } else if (name == "profile") {
+      options.profile = true;
+      options.profile_path = value;
+    } else if (name == "long-call-time" && !value.empty()) {
+      options.long_call_time = value;
+    } else if (name == "long-call-abort") {
+      options.long_call_abort = true;
+    } else if (name == "timeslice" && std::atol(value.c_str()) > 0) {
+      options.timeslice = std::atol(value.c_str());
+    } else if (name == "tests") {
+      options.test_prefix = value.empty() ? "Test_" : value;
+    } else {
+      std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+      return -1;
+    }
+  }
+  return i;
+}
+
 } // anonymous namespace
 
 int main(int argc, char **argv) {
+  Options options;
+  int first_arg = ParseOptions(argc, argv, options);
+  if (first_arg < 0) {
+    return EXIT_FAILURE;
+  }
+  // Console output is fully buffered unless asked otherwise; it's flushed
+  // after every tick and at exit.
+  amx_ConsoleBuffer(options.line_flush);
+
+  // Test workers are started with the same arguments, less --jobs.
+  std::vector<std::string> command;
+  for (int i = 0; i < argc; i++) {
+    if (i == 0 || i >= first_arg || std::strncmp(argv[i], "--jobs", 6) != 0) {
+      command.push_back(argv[i]);
+    }
+  }
+
+  // Drop the runner options so that the rest of the code doesn't see them.
+  argv[first_arg - 1] = argv[0];
+  argv += first_arg - 1;
+  argc -= first_arg - 1;
+
   // Find the start of config options (`--`).
   int optc = argc;
   for (int i = 1; i < argc; i++) {
@@ -338,9 +740,58 @@ int main(int argc, char **argv) {
 
   if (argc < 2) {
     std::fprintf(stderr,
-                 "Usage: plugin-runner [plugin1 [plugin2 [...]]] amx_file [-- opt1 [opt2 [...]]]\n");
+                 "Usage: plugin-runner [--options] [plugin1 [plugin2 [...]]] amx_file [-- opt1 [opt2 [...]]]\n"
+                 "\n"
+                 "Options:\n"
+                 "  --log-file=<path>  append log output to a file\n"
+                 "  --async-log        write log output from a background thread\n"
+                 "  --line-flush       flush console output after every line\n"
+                 "  --instances=<n>    run n instances of the script sharing one\n"
+                 "                     copy of the code\n"
+                 "  --tests[=<prefix>] run all publics starting with prefix\n"
+                 "                     (Test_ by default) after main, each from\n"
+                 "                     the state main left the script in\n"
+                 "  --jobs=<n>         run the tests in n worker processes\n"
+                 "  --shard=<i>/<n>    run only every n-th test, starting from\n"
+                 "                     test number i (counting from 0)\n"
+                 "  --bench[=<prefix>] time all publics starting with prefix\n"
+                 "                     (Bench_ by default) after main\n"
+                 "  --bench-json=<path> write benchmark results to a JSON file\n"
+                 "  --bench-baseline=<path>\n"
+                 "                     compare benchmark results with a JSON\n"
+                 "                     file written by an earlier run\n"
+                 "  --profile[=<path>] report the time spent in publics called\n"
+                 "                     by plugins at exit\n"
+                 "  --long-call-time=<us>\n"
+                 "                     log the call stack of calls that take\n"
+                 "                     longer (overrides long_call_time)\n"
+                 "  --long-call-abort  also abort such calls\n"
+                 "  --timeslice=<n>    suspend calls after about n instructions\n"
+                 "                     and continue them between ticks\n"
+                 "  --warm-start=<path> restore the state of the script after\n"
+                 "                     main from a snapshot file instead of\n"
+                 "                     running main, or create one\n"
+                 "  --fork-server=<socket>\n"
+                 "                     after main, serve test requests on a\n"
+                 "                     Unix socket, each run in a forked child\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!options.log_file.empty() && !SetLogFile(options.log_file)) {
+    std::fprintf(stderr, "Error: Could not open log file `%s`\n",
+                 options.log_file.c_str());
+    return EXIT_FAILURE;
+  }
+  // Forked children would have no writer thread, and could inherit the
+  // output locked by it.
+  if (options.async_log && !options.fork_server.empty()) {
+    std::fprintf(stderr,
+                 "Error: --async-log can't be used with --fork-server\n");
     return EXIT_FAILURE;
   }
+  if (options.async_log) {
+    StartAsyncLog();
+  }
 
   if (argc == optc) {
     // No options given.  Ensure the file is missing (tests plugins check that).
@@ -353,6 +804,34 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  if (!options.test_prefix.empty() && options.jobs > 1) {
+    int num_failed = RunTestShards(command, options.jobs);
+    StopLog();
+    return num_failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  // Plugins may keep the function pointers they get in Load().
+  if (options.profile) {
+    StartProfiler(amx_functions);
+  }
+  // Like crashdetect, long_call_time in server.cfg is in microseconds.
+  if (options.long_call_time.empty() && argc != optc) {
+    options.long_call_time =
+      GetConfigOption(optc - argc - 1, argv + argc + 1, "long_call_time");
+  }
+  long long long_call_time = std::atoll(options.long_call_time.c_str());
+  if (long_call_time > 0) {
+    StartWatchdog(amx_functions, long_call_time, options.long_call_abort);
+  }
+  // Tests, benchmarks and the fork server start once main has returned, a
+  // main that is suspended halfway would leave them with a script that is
+  // not set up.
+  if (options.test_prefix.empty()
+      && options.bench.prefix.empty()
+      && options.fork_server.empty()) {
+    SetTimeslice(options.timeslice);
+  }
+
   std::list<Plugin *> plugins;
   if (argc >= 3) {
     for (int i = 1; i < argc - 1; i++) {
@@ -368,28 +847,129 @@ int main(int argc, char **argv) {
     amx_path.append(AMX_FILE_EXT);
   }
 
-  AMX amx = {0};
+  // The first instance is the loaded script, the others are its clones.
+  std::list<AMX> instances(1);
   int exit_status = EXIT_SUCCESS;
-
-  if (LoadScript(&amx, amx_path)) {
-    for (auto &plugin : plugins) {
-      if (plugin->GetSupportsFlags() & SUPPORTS_AMX_NATIVES) {
-        plugin->AmxLoad(&amx);
+  // Calls to main that were suspended; their status comes when they finish.
+  std::vector<int> main_calls;
+  bool script_loaded = LoadScript(&instances.front(), amx_path);
+
+  if (script_loaded) {
+    for (int i = 1; i < options.instances; i++) {
+      instances.emplace_back();
+      if (!CloneScript(&instances.back(), &instances.front())) {
+        std::printf("Could not create script instance %d\n", i + 1);
+        instances.pop_back();
+        break;
       }
-      if (plugin->GetSupportsFlags() & SUPPORTS_PROCESS_TICK) {
-        process_ticks = true;
+    }
+    if (instances.size() > 1) {
+      PrintMemoryUsage(&instances.front(), instances.size());
+    }
+    for (auto &amx : instances) {
+      for (auto &plugin : plugins) {
+        if (plugin->GetSupportsFlags() & SUPPORTS_AMX_NATIVES) {
+          plugin->AmxLoad(&amx);
+        }
+        if (plugin->GetSupportsFlags() & SUPPORTS_PROCESS_TICK) {
+          process_ticks = true;
+        }
       }
     }
-    if (CheckAmxNatives(&amx)) {
-      exit_status = RunScriptMain(&amx);
+    if (CheckAmxNatives(&instances.front())) {
+      // A warm start snapshot holds the state of the script after main,
+      // taken in an earlier run with the same script and plugins; the
+      // plugins have seen AmxLoad() already so their natives are bound.
+      Snapshot warm_start;
+      std::uint64_t warm_start_key = 0;
+      bool warm = false;
+      if (!options.warm_start.empty()) {
+        warm_start_key = GetWarmStartKey(amx_path, plugins);
+        warm = warm_start.Load(options.warm_start, warm_start_key);
+        if (warm) {
+          std::printf("Restored script state from %s\n",
+                      options.warm_start.c_str());
+        }
+      }
+      for (auto &amx : instances) {
+        int status;
+        if (warm && warm_start.Restore(&amx)) {
+          // PRI still holds the return value of main.
+          status = amx.pri;
+        } else {
+          bool completed = false;
+          int call_id = 0;
+          status = RunScriptMain(&amx, &completed, &call_id);
+          if (call_id != 0) {
+            // Suspended in wait_ms(): the status comes when main finishes.
+            main_calls.push_back(call_id);
+            continue;
+          }
+          if (!options.warm_start.empty() && !warm
+              && &amx == &instances.front() && completed) {
+            warm_start.Take(&amx);
+            if (!warm_start.Save(options.warm_start, warm_start_key)) {
+              std::printf("Could not write snapshot to %s\n",
+                          options.warm_start.c_str());
+            }
+          }
+        }
+        if (exit_status == EXIT_SUCCESS) {
+          exit_status = status;
+        }
+      }
+      if (!options.test_prefix.empty()
+          || !options.bench.prefix.empty()
+          || !options.fork_server.empty()) {
+        // Tests, benchmarks and the fork server start from the state main
+        // leaves behind, so a main that waits in wait_ms() must finish first.
+        while (!main_calls.empty()) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          ProcessCoroutines();
+          CollectMainStatus(main_calls, exit_status);
+        }
+      }
+      if (!options.test_prefix.empty()
+          && RunTests(&instances.front(), options.test_prefix,
+                      options.shard, options.num_shards) > 0) {
+        exit_status = EXIT_FAILURE;
+      }
+      if (!options.bench.prefix.empty()
+          && RunBenchmarks(&instances.front(), options.bench) > 0) {
+        exit_status = EXIT_FAILURE;
+      }
+      if (!options.fork_server.empty()) {
+        // Worker threads don't survive fork(); children start their own.
+        ParallelCleanup(&instances.front());
+        if (!RunForkServer(&instances.front(), options.fork_server)) {
+          exit_status = EXIT_FAILURE;
+        }
+      }
     }
-    UnloadScript(&amx);
   }
 
-  if (process_ticks) {
+  // Keep ticking while plugins want it or while the script still waits for
+  // asynchronous operations to complete, timers to fire or suspended calls
+  // to be resumed.
+  // A fork server is done once it has been told to quit.
+  bool keep_running = options.fork_server.empty();
+  if (keep_running && process_ticks) {
     std::printf("Running indefinitely because ProcessTick() was requested\n");
-    while (process_ticks) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  while (keep_running
+         && (process_ticks
+             || HasPendingAsyncFileOps()
+             || HasActiveTimers()
+             || HasSuspendedScripts())) {
+    // Calls that ran out of their timeslice use up the time until the next
+    // tick, one slice at a time.
+    auto next_tick = std::chrono::steady_clock::now()
+                     + std::chrono::milliseconds(5);
+    while (HasReadyScripts() && std::chrono::steady_clock::now() < next_tick) {
+      ProcessCoroutines();
+    }
+    std::this_thread::sleep_until(next_tick);
+    if (process_ticks) {
       for (auto &plugin : plugins) {
         if (plugin->IsLoaded()
             && plugin->GetSupportsFlags() & SUPPORTS_PROCESS_TICK) {
@@ -397,19 +977,45 @@ int main(int argc, char **argv) {
         }
       }
     }
+    ProcessAsyncFileCompletions();
+    ProcessTimers();
+    ProcessCoroutines();
+    CollectMainStatus(main_calls, exit_status);
+    amx_ConsoleFlush();
+  }
+
+  if (script_loaded) {
+    if (options.profile && !WriteProfile(options.profile_path)) {
+      std::printf("Could not write profile to %s\n",
+                  options.profile_path.c_str());
+    }
+    for (auto &amx : instances) {
+      UnloadScript(&amx);
+    }
   }
 
   for (auto &plugin : plugins) {
     if (!plugin->IsLoaded()) {
       continue;
     }
-    if (amx.base != nullptr
-        && plugin->GetSupportsFlags() & SUPPORTS_AMX_NATIVES) {
-      plugin->AmxUnload(&amx);
+    if (plugin->GetSupportsFlags() & SUPPORTS_AMX_NATIVES) {
+      for (auto &amx : instances) {
+        if (amx.base != nullptr) {
+          plugin->AmxUnload(&amx);
+        }
+      }
     }
     plugin->Unload();
   }
+
+  // Clones have their own data blocks.
+  for (auto amx = std::next(instances.begin()); amx != instances.end(); ++amx) {
+    std::free(amx->data);
+  }
   plugins.erase(plugins.begin(), plugins.end());
 
+  StopWatchdog();
+  StopLog();
+  amx_ConsoleFlush();
   return exit_status;
 }
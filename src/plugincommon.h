@@ -112,6 +112,11 @@ enum PLUGIN_AMX_EXPORT
 	PLUGIN_AMX_EXPORT_UTF8Get		= 41,
 	PLUGIN_AMX_EXPORT_UTF8Len		= 42,
 	PLUGIN_AMX_EXPORT_UTF8Put		= 43,
+
+	// Plugin runner extensions, not available in the SA-MP server
+	PLUGIN_AMX_EXPORT_PushArgs		= 44,	// int (*)(AMX*, const cell args[], int numargs)
+	PLUGIN_AMX_EXPORT_PrepareCall	= 45,	// int (*)(AMX*, const char *funcname, AMX_CALL*)
+	PLUGIN_AMX_EXPORT_ExecCall		= 46,	// int (*)(const AMX_CALL*, cell *retval, const cell args[], int numargs)
 };
 
 //----------------------------------------------------------
@@ -0,0 +1,272 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "plugincommon.h"
+#include "profiler.h"
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <time.h>
+#endif
+
+namespace {
+
+// A public function of a script; the index can also be AMX_EXEC_MAIN or
+// AMX_EXEC_CONT.
+using Function = std::pair<AMX *, int>;
+
+struct Stats {
+  std::uint64_t calls = 0;
+  std::uint64_t total_time = 0;
+  std::uint64_t self_time = 0;
+  std::uint64_t max_time = 0;
+  std::uint64_t cpu_time = 0;
+  std::uint64_t instructions = 0;
+};
+
+struct CallStats {
+  std::uint64_t calls = 0;
+  std::uint64_t total_time = 0;
+};
+
+// A call in progress. The time of nested calls is subtracted from the self
+// time of their caller.
+struct Frame {
+  Function function;
+  std::uint64_t start_time;
+  std::uint64_t start_cpu_time;
+  std::uint64_t start_instructions;
+  std::uint64_t nested_time;
+  std::uint64_t nested_instructions;
+};
+
+std::mutex mutex;
+std::map<Function, Stats> stats;
+std::map<std::pair<Function, Function>, CallStats> nested_calls;
+thread_local std::vector<Frame> call_stack;
+
+std::uint64_t Now() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+std::uint64_t ThreadCpuTime() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  auto ticks = [](const FILETIME &time) {
+    return (static_cast<std::uint64_t>(time.dwHighDateTime) << 32)
+           | time.dwLowDateTime;
+  };
+  return (ticks(kernel) + ticks(user)) * 100;
+#else
+  timespec time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) {
+    return 0;
+  }
+  return static_cast<std::uint64_t>(time.tv_sec) * 1000000000
+         + time.tv_nsec;
+#endif
+}
+
+#ifdef AMX_COUNT_INSTRUCTIONS
+  const bool COUNT_INSTRUCTIONS = true;
+#else
+  const bool COUNT_INSTRUCTIONS = false;
+#endif
+
+std::uint64_t InstructionCount() {
+#ifdef AMX_COUNT_INSTRUCTIONS
+  return amx_InstructionCount();
+#else
+  return 0;
+#endif
+}
+
+void EnterFunction(AMX *amx, int index) {
+  Frame frame;
+  frame.function = Function(amx, index);
+  frame.nested_time = 0;
+  frame.nested_instructions = 0;
+  frame.start_instructions = InstructionCount();
+  frame.start_cpu_time = ThreadCpuTime();
+  frame.start_time = Now();
+  call_stack.push_back(frame);
+}
+
+void LeaveFunction() {
+  std::uint64_t end_time = Now();
+  std::uint64_t end_cpu_time = ThreadCpuTime();
+  std::uint64_t end_instructions = InstructionCount();
+
+  Frame frame = call_stack.back();
+  call_stack.pop_back();
+  std::uint64_t time = end_time - frame.start_time;
+  std::uint64_t instructions = end_instructions - frame.start_instructions;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats &s = stats[frame.function];
+  s.calls++;
+  s.total_time += time;
+  s.self_time += time - std::min(time, frame.nested_time);
+  s.max_time = std::max(s.max_time, time);
+  s.cpu_time += end_cpu_time - frame.start_cpu_time;
+  s.instructions += instructions - frame.nested_instructions;
+
+  if (!call_stack.empty()) {
+    Frame &caller = call_stack.back();
+    caller.nested_time += time;
+    caller.nested_instructions += instructions;
+    CallStats &c = nested_calls[std::make_pair(caller.function,
+                                               frame.function)];
+    c.calls++;
+    c.total_time += time;
+  }
+}
+
+int AMXAPI ProfileExec(AMX *amx, cell *retval, int index) {
+  EnterFunction(amx, index);
+  int error = amx_Exec(amx, retval, index);
+  LeaveFunction();
+  return error;
+}
+
+int AMXAPI ProfileExecCall(const AMX_CALL *call,
+                           cell *retval,
+                           const cell args[],
+                           int numargs) {
+  EnterFunction(call->amx, call->index);
+  int error = amx_ExecCall(call, retval, args, numargs);
+  LeaveFunction();
+  return error;
+}
+
+std::string GetFunctionName(const Function &function) {
+  char name[sNAMEMAX + 1];
+  if (function.second == AMX_EXEC_MAIN) {
+    return "main";
+  }
+  if (function.second == AMX_EXEC_CONT) {
+    return "(continue)";
+  }
+  if (amx_GetPublic(function.first, function.second, name) != AMX_ERR_NONE) {
+    return "(" + std::to_string(function.second) + ")";
+  }
+  return name;
+}
+
+double Milliseconds(std::uint64_t ns) {
+  return static_cast<double>(ns) / 1000000;
+}
+
+} // anonymous namespace
+
+void StartProfiler(void **amx_functions) {
+  amx_functions[PLUGIN_AMX_EXPORT_Exec] = (void *)ProfileExec;
+  amx_functions[PLUGIN_AMX_EXPORT_ExecCall] = (void *)ProfileExecCall;
+}
+
+bool WriteProfile(const std::string &path) {
+  std::FILE *file = stdout;
+  if (!path.empty()) {
+    file = std::fopen(path.c_str(), "w");
+    if (file == nullptr) {
+      return false;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Tell the scripts apart if there are several.
+  std::vector<AMX *> scripts;
+  for (auto &entry : stats) {
+    if (std::find(scripts.begin(), scripts.end(), entry.first.first)
+        == scripts.end()) {
+      scripts.push_back(entry.first.first);
+    }
+  }
+  auto get_label = [&scripts](const Function &function) {
+    std::string label = GetFunctionName(function);
+    if (scripts.size() > 1) {
+      auto script = std::find(scripts.begin(), scripts.end(), function.first);
+      label += " #" + std::to_string(script - scripts.begin() + 1);
+    }
+    return label;
+  };
+
+  std::vector<std::pair<Function, Stats>> rows(stats.begin(), stats.end());
+  std::sort(rows.begin(), rows.end(),
+    [](const std::pair<Function, Stats> &a,
+       const std::pair<Function, Stats> &b) {
+      return a.second.self_time > b.second.self_time;
+    });
+
+  std::fprintf(file, "%-32s %10s %12s %12s %12s %12s %14s\n",
+               "public", "calls", "total ms", "self ms", "max ms", "cpu ms",
+               "instructions");
+  for (auto &row : rows) {
+    const Stats &s = row.second;
+    std::string instructions = COUNT_INSTRUCTIONS
+                               ? std::to_string(s.instructions) : "-";
+    std::fprintf(file, "%-32s %10llu %12.3f %12.3f %12.3f %12.3f %14s\n",
+                 get_label(row.first).c_str(),
+                 static_cast<unsigned long long>(s.calls),
+                 Milliseconds(s.total_time),
+                 Milliseconds(s.self_time),
+                 Milliseconds(s.max_time),
+                 Milliseconds(s.cpu_time),
+                 instructions.c_str());
+  }
+
+  if (!nested_calls.empty()) {
+    std::fprintf(file, "\n%-32s %-32s %10s %12s\n",
+                 "caller", "callee", "calls", "total ms");
+    for (auto &entry : nested_calls) {
+      std::fprintf(file, "%-32s %-32s %10llu %12.3f\n",
+                   get_label(entry.first.first).c_str(),
+                   get_label(entry.first.second).c_str(),
+                   static_cast<unsigned long long>(entry.second.calls),
+                   Milliseconds(entry.second.total_time));
+    }
+  }
+
+  if (file != stdout) {
+    return std::fclose(file) == 0;
+  }
+  return true;
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include "amx/amx.h"
+
+// Profiles the public functions that plugins call. StartProfiler() replaces
+// amx_Exec() and amx_ExecCall() in the table of AMX functions given to
+// plugins with versions that record, for every public, the number of calls,
+// the wall clock and CPU time spent in it with and without the publics it
+// called in turn, and, in builds with AMX_COUNT_INSTRUCTIONS, the number of
+// instructions executed. Calls made by the runner itself are not counted.
+//
+// It must be called before the plugins are loaded, as they may keep the
+// function pointers.
+void StartProfiler(void **amx_functions);
+
+// Prints the collected data to the given file, or to stdout if "path" is
+// empty. The scripts must still be loaded, to look up the names of their
+// publics.
+bool WriteProfile(const std::string &path);
+
+#endif // !PROFILER_H
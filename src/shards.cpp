@@ -0,0 +1,150 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "shards.h"
+
+#ifdef _WIN32
+  #define popen _popen
+  #define pclose _pclose
+#endif
+
+namespace {
+
+struct Shard {
+  std::FILE *output = nullptr;
+  int num_tests = 0;
+  int num_failed = 0;
+  bool finished = false;
+};
+
+std::mutex output_mutex;
+
+std::string Quote(const std::string &arg) {
+#ifdef _WIN32
+  std::string quoted = "\"";
+  for (char c : arg) {
+    if (c == '"') {
+      quoted += '\\';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+#else
+  std::string quoted = "'";
+  for (char c : arg) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+#endif
+}
+
+// Reads the output of a worker until it exits.
+void ReadShardOutput(Shard &shard) {
+  std::string line;
+  char buffer[4096];
+  while (std::fgets(buffer, sizeof(buffer), shard.output) != nullptr) {
+    line += buffer;
+    if (line.back() != '\n') {
+      continue;
+    }
+    int num_tests;
+    int num_failed;
+    if (std::sscanf(line.c_str(), "%d tests, %d failed",
+                    &num_tests, &num_failed) == 2) {
+      shard.num_tests = num_tests;
+      shard.num_failed = num_failed;
+      shard.finished = true;
+    } else {
+      std::lock_guard<std::mutex> lock(output_mutex);
+      std::fputs(line.c_str(), stdout);
+    }
+    line.clear();
+  }
+}
+
+} // anonymous namespace
+
+int RunTestShards(const std::vector<std::string> &command, int num_shards) {
+  // The shard option goes first: everything after "--" is passed on to
+  // server.cfg.
+  std::string arguments;
+  for (std::size_t i = 1; i < command.size(); i++) {
+    arguments += " " + Quote(command[i]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::fflush(stdout);
+  std::vector<Shard> shards(num_shards);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < num_shards; i++) {
+    std::string shard_command = Quote(command[0]) + " --shard="
+                                + std::to_string(i) + "/"
+                                + std::to_string(num_shards) + arguments;
+#ifdef _WIN32
+    // cmd.exe strips the outermost pair of quotes.
+    shard_command = "\"" + shard_command + "\"";
+#endif
+    shards[i].output = popen(shard_command.c_str(), "r");
+    if (shards[i].output == nullptr) {
+      std::printf("Could not start test worker %d\n", i + 1);
+      continue;
+    }
+    readers.emplace_back(ReadShardOutput, std::ref(shards[i]));
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+
+  int num_tests = 0;
+  int num_failed = 0;
+  for (int i = 0; i < num_shards; i++) {
+    Shard &shard = shards[i];
+    if (shard.output != nullptr) {
+      pclose(shard.output);
+    }
+    if (!shard.finished) {
+      std::printf("Test worker %d did not finish\n", i + 1);
+      num_failed++;
+    }
+    num_tests += shard.num_tests;
+    num_failed += shard.num_failed;
+  }
+  auto time = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  std::printf("%d tests, %d failed (%d workers, %.3f s)\n",
+              num_tests, num_failed, num_shards, time / 1000.0);
+  return num_failed;
+}
@@ -0,0 +1,274 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "snapshot.h"
+
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace {
+
+unsigned char *GetData(AMX *amx) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  return amx->data != nullptr ? amx->data : amx->base + hdr->dat;
+}
+
+std::size_t GetDataSize(AMX *amx) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  return static_cast<std::size_t>(hdr->stp - hdr->dat);
+}
+
+// The header of a snapshot file, followed by the data, heap and stack.
+struct FileHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint64_t key;
+  std::uint64_t size;
+  cell registers[8];
+};
+
+const char FILE_MAGIC[4] = {'A', 'M', 'X', 'S'};
+const std::uint32_t FILE_VERSION = 1;
+
+#ifdef __linux__
+
+// Bit 55 of a page map entry is set if the page was written since the
+// soft-dirty bits were last cleared.
+const std::uint64_t PAGEMAP_SOFT_DIRTY = std::uint64_t(1) << 55;
+
+// Clears the soft-dirty bits of all pages of the process.
+bool ClearSoftDirty() {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = write(fd, "4", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+bool ReadPageMap(std::uintptr_t first_page, std::uintptr_t num_pages,
+                 std::uint64_t *entries) {
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  auto size = static_cast<ssize_t>(num_pages * sizeof(std::uint64_t));
+  bool ok = pread(fd, entries, size,
+                  first_page * sizeof(std::uint64_t)) == size;
+  close(fd);
+  return ok;
+}
+
+// Not every kernel is built with soft-dirty tracking, and clearing the bits
+// succeeds regardless; check that writing to a page actually marks it.
+bool IsSoftDirtySupported() {
+  static int supported = -1;
+  if (supported < 0) {
+    auto page_size = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    std::vector<unsigned char> buffer(page_size * 2);
+    auto page = (reinterpret_cast<std::uintptr_t>(buffer.data())
+                 + page_size - 1) / page_size;
+    auto probe = reinterpret_cast<volatile unsigned char *>(page * page_size);
+    std::uint64_t entry = 0;
+    supported = 0;
+    if (ClearSoftDirty()) {
+      *probe = 1;
+      if (ReadPageMap(page, 1, &entry)) {
+        supported = (entry & PAGEMAP_SOFT_DIRTY) != 0;
+      }
+    }
+  }
+  return supported != 0;
+}
+
+#endif
+
+} // anonymous namespace
+
+Snapshot::Snapshot()
+  : cip_(0),
+    frm_(0),
+    hea_(0),
+    stk_(0),
+    pri_(0),
+    alt_(0),
+    reset_stk_(0),
+    reset_hea_(0),
+    track_dirty_pages_(false),
+    restored_size_(0) {
+}
+
+bool Snapshot::Take(AMX *amx) {
+  unsigned char *data = GetData(amx);
+  data_.assign(data, data + GetDataSize(amx));
+  cip_ = amx->cip;
+  frm_ = amx->frm;
+  hea_ = amx->hea;
+  stk_ = amx->stk;
+  pri_ = amx->pri;
+  alt_ = amx->alt;
+  reset_stk_ = amx->reset_stk;
+  reset_hea_ = amx->reset_hea;
+#ifdef __linux__
+  track_dirty_pages_ = IsSoftDirtySupported() && ClearSoftDirty();
+#endif
+  return true;
+}
+
+bool Snapshot::Restore(AMX *amx) {
+  if (data_.size() != GetDataSize(amx)) {
+    return false;
+  }
+  unsigned char *data = GetData(amx);
+  if (!track_dirty_pages_ || !RestoreDirtyPages(data)) {
+    std::memcpy(data, data_.data(), data_.size());
+    restored_size_ = data_.size();
+  }
+  amx->cip = cip_;
+  amx->frm = frm_;
+  amx->hea = hea_;
+  amx->stk = stk_;
+  amx->pri = pri_;
+  amx->alt = alt_;
+  amx->reset_stk = reset_stk_;
+  amx->reset_hea = reset_hea_;
+  amx->paramcount = 0;
+  amx->error = AMX_ERR_NONE;
+  return true;
+}
+
+bool Snapshot::Save(const std::string &path, std::uint64_t key) const {
+  FileHeader header = {
+    {FILE_MAGIC[0], FILE_MAGIC[1], FILE_MAGIC[2], FILE_MAGIC[3]},
+    FILE_VERSION,
+    key,
+    data_.size(),
+    {cip_, frm_, hea_, stk_, pri_, alt_, reset_stk_, reset_hea_}
+  };
+
+  // Write to a temporary file first so that a run interrupted half way
+  // doesn't leave a broken snapshot behind.
+  std::string temp_path = path + ".tmp";
+  std::FILE *file = std::fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+            && std::fwrite(data_.data(), data_.size(), 1, file) == 1;
+  ok = std::fclose(file) == 0 && ok;
+  if (ok) {
+    std::remove(path.c_str());
+    ok = std::rename(temp_path.c_str(), path.c_str()) == 0;
+  }
+  if (!ok) {
+    std::remove(temp_path.c_str());
+  }
+  return ok;
+}
+
+bool Snapshot::Load(const std::string &path, std::uint64_t key) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  FileHeader header;
+  bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+            && std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) == 0
+            && header.version == FILE_VERSION
+            && header.key == key;
+  if (ok) {
+    data_.resize(static_cast<std::size_t>(header.size));
+    ok = std::fread(data_.data(), data_.size(), 1, file) == 1;
+  }
+  std::fclose(file);
+  if (!ok) {
+    data_.clear();
+    return false;
+  }
+  cip_ = header.registers[0];
+  frm_ = header.registers[1];
+  hea_ = header.registers[2];
+  stk_ = header.registers[3];
+  pri_ = header.registers[4];
+  alt_ = header.registers[5];
+  reset_stk_ = header.registers[6];
+  reset_hea_ = header.registers[7];
+  track_dirty_pages_ = false;
+  return true;
+}
+
+#ifdef __linux__
+
+bool Snapshot::RestoreDirtyPages(unsigned char *data) {
+  auto page_size = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+  auto begin = reinterpret_cast<std::uintptr_t>(data);
+  auto end = begin + data_.size();
+  std::uintptr_t first_page = begin / page_size;
+  std::uintptr_t num_pages = (end + page_size - 1) / page_size - first_page;
+
+  std::vector<std::uint64_t> entries(num_pages);
+  if (!ReadPageMap(first_page, num_pages, entries.data())) {
+    return false;
+  }
+
+  // Copy back runs of dirty pages; the first and the last page may be only
+  // partly inside the block.
+  restored_size_ = 0;
+  std::uintptr_t page = 0;
+  while (page < num_pages) {
+    if ((entries[page] & PAGEMAP_SOFT_DIRTY) == 0) {
+      page++;
+      continue;
+    }
+    std::uintptr_t run_end = page + 1;
+    while (run_end < num_pages
+           && (entries[run_end] & PAGEMAP_SOFT_DIRTY) != 0) {
+      run_end++;
+    }
+    std::uintptr_t from = std::max(begin, (first_page + page) * page_size);
+    std::uintptr_t to = std::min(end, (first_page + run_end) * page_size);
+    std::memcpy(data + (from - begin), data_.data() + (from - begin),
+                to - from);
+    restored_size_ += to - from;
+    page = run_end;
+  }
+  return ClearSoftDirty();
+}
+
+#else
+
+bool Snapshot::RestoreDirtyPages(unsigned char *data) {
+  return false;
+}
+
+#endif
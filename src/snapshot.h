@@ -0,0 +1,76 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "amx/amx.h"
+
+// A copy of the state of an abstract machine: its data, heap and stack and
+// its registers. Restoring it only copies back the pages that were written
+// since the snapshot was taken, found through the kernel's soft-dirty page
+// tracking on Linux; elsewhere the whole block is copied.
+//
+// State kept outside of the abstract machine (open files, timers, plugin
+// data and so on) is not part of the snapshot.
+class Snapshot {
+ public:
+  Snapshot();
+
+  bool Take(AMX *amx);
+  bool Restore(AMX *amx);
+
+  // Saves the snapshot to a file tagged with "key", or loads one that was
+  // saved with the same key. A loaded snapshot can be restored into any
+  // instance of the script it was taken from.
+  bool Save(const std::string &path, std::uint64_t key) const;
+  bool Load(const std::string &path, std::uint64_t key);
+
+  bool IsEmpty() const { return data_.empty(); }
+
+  // The number of bytes copied back by the last Restore().
+  std::size_t GetRestoredSize() const { return restored_size_; }
+
+ private:
+  bool RestoreDirtyPages(unsigned char *data);
+
+  std::vector<unsigned char> data_;
+  cell cip_;
+  cell frm_;
+  cell hea_;
+  cell stk_;
+  cell pri_;
+  cell alt_;
+  cell reset_stk_;
+  cell reset_hea_;
+  bool track_dirty_pages_;
+  std::size_t restored_size_;
+};
+
+#endif // !SNAPSHOT_H
@@ -0,0 +1,414 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+#include "coroutines.h"
+#include "timers.h"
+
+namespace {
+
+// The first level of the wheel has one slot per millisecond; each of the
+// following levels covers 64 slots of the level below it. Together they
+// span 2^32 milliseconds (about 49 days), longer intervals are clamped.
+const int ROOT_BITS = 8;
+const int LEVEL_BITS = 6;
+const int NUM_LEVELS = 4;
+const std::uint64_t ROOT_SIZE = 1 << ROOT_BITS;
+const std::uint64_t LEVEL_SIZE = 1 << LEVEL_BITS;
+const std::uint64_t MAX_DELAY =
+  (std::uint64_t(1) << (ROOT_BITS + NUM_LEVELS * LEVEL_BITS)) - 1;
+
+// An argument of SetTimerEx(). Strings and arrays are copied when the timer
+// is set, so the script may reuse its variables in the meantime.
+struct Argument {
+  bool is_array;
+  cell value;
+  std::vector<cell> data;
+};
+
+struct Timer {
+  // Links in the list of a wheel slot.
+  Timer *next;
+  Timer **pprev;
+
+  cell id;
+  AMX *amx;
+  int index;
+  std::uint64_t expires;
+  std::uint64_t interval;
+  bool repeat;
+  std::vector<Argument> args;
+};
+
+Timer *root[ROOT_SIZE];
+Timer *levels[NUM_LEVELS][LEVEL_SIZE];
+
+// The next millisecond to be processed.
+std::uint64_t current_time = 0;
+
+std::unordered_map<cell, Timer *> timers;
+cell next_id = 1;
+
+// Timers that expired in the current millisecond and have not run yet.
+Timer *expired = nullptr;
+// The timer whose callback is executing, if any, and whether the callback
+// killed it.
+Timer *running = nullptr;
+bool running_killed = false;
+
+std::uint64_t Now() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+void Link(Timer *timer, Timer **head) {
+  timer->next = *head;
+  if (*head != nullptr) {
+    (*head)->pprev = &timer->next;
+  }
+  *head = timer;
+  timer->pprev = head;
+}
+
+void Unlink(Timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != nullptr) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = nullptr;
+  timer->pprev = nullptr;
+}
+
+void Schedule(Timer *timer) {
+  if (timer->expires < current_time) {
+    timer->expires = current_time;
+  }
+  std::uint64_t delay = timer->expires - current_time;
+  if (delay > MAX_DELAY) {
+    timer->expires = current_time + MAX_DELAY;
+    delay = MAX_DELAY;
+  }
+  if (delay < ROOT_SIZE) {
+    Link(timer, &root[timer->expires & (ROOT_SIZE - 1)]);
+    return;
+  }
+  for (int level = 0; level < NUM_LEVELS; level++) {
+    int shift = ROOT_BITS + (level + 1) * LEVEL_BITS;
+    if (level == NUM_LEVELS - 1 || delay < (std::uint64_t(1) << shift)) {
+      int slot = (timer->expires >> (shift - LEVEL_BITS)) & (LEVEL_SIZE - 1);
+      Link(timer, &levels[level][slot]);
+      return;
+    }
+  }
+}
+
+// Moves the timers of a slot of a higher level down to the lower levels.
+// Returns the slot index, which is zero when the level itself has wrapped
+// around and the next level must be cascaded too.
+int Cascade(int level) {
+  int shift = ROOT_BITS + level * LEVEL_BITS;
+  int slot = (current_time >> shift) & (LEVEL_SIZE - 1);
+  Timer *list = levels[level][slot];
+  levels[level][slot] = nullptr;
+  while (list != nullptr) {
+    Timer *timer = list;
+    list = timer->next;
+    Schedule(timer);
+  }
+  return slot;
+}
+
+void DeleteTimer(Timer *timer) {
+  timers.erase(timer->id);
+  delete timer;
+}
+
+void CallTimer(Timer *timer) {
+  AMX *amx = timer->amx;
+
+  // Arguments are pushed in reverse order. The heap block of the first
+  // array pushed is the lowest one, releasing it frees all the others.
+  cell heap_addr = -1;
+  for (auto arg = timer->args.rbegin(); arg != timer->args.rend(); ++arg) {
+    if (arg->is_array) {
+      cell amx_addr;
+      if (amx_PushArray(amx, &amx_addr, nullptr, arg->data.data(),
+                        static_cast<int>(arg->data.size()))
+          == AMX_ERR_NONE && heap_addr == -1) {
+        heap_addr = amx_addr;
+      }
+    } else {
+      amx_Push(amx, arg->value);
+    }
+  }
+
+  cell retval;
+  int error = ExecScript(amx, &retval, timer->index);
+  if (error != AMX_ERR_NONE) {
+    std::printf("Error while executing timer %d: %d\n",
+                static_cast<int>(timer->id), error);
+  }
+  if (heap_addr != -1) {
+    amx_Release(amx, heap_addr);
+  }
+}
+
+void RunTimer(Timer *timer, std::uint64_t now) {
+  running = timer;
+  running_killed = false;
+  CallTimer(timer);
+  running = nullptr;
+
+  if (!timer->repeat || running_killed) {
+    DeleteTimer(timer);
+    return;
+  }
+
+  // If we fell behind, skip the missed periods instead of calling the timer
+  // several times in a row.
+  timer->expires += timer->interval;
+  if (timer->expires <= now) {
+    timer->expires +=
+      ((now - timer->expires) / timer->interval + 1) * timer->interval;
+  }
+  Schedule(timer);
+}
+
+Timer *NewTimer(AMX *amx, const cell *params) {
+  char *name;
+  amx_StrParam(amx, params[1], name);
+  int index;
+  if (name == nullptr
+      || amx_FindPublic(amx, name, &index) != AMX_ERR_NONE) {
+    return nullptr;
+  }
+
+  auto timer = new Timer;
+  timer->next = nullptr;
+  timer->pprev = nullptr;
+  timer->id = 0;
+  timer->amx = amx;
+  timer->index = index;
+  timer->interval = params[2] > 0 ? static_cast<std::uint64_t>(params[2]) : 1;
+  timer->repeat = params[3] != 0;
+  return timer;
+}
+
+cell AddTimer(Timer *timer) {
+  if (timers.empty()) {
+    current_time = Now();
+  }
+  timer->id = next_id++;
+  if (next_id <= 0) {
+    next_id = 1;
+  }
+  timer->expires = Now() + timer->interval;
+  timers[timer->id] = timer;
+  Schedule(timer);
+  return timer->id;
+}
+
+// Copies a string or an array of the given size from the abstract machine.
+bool GetArgumentData(AMX *amx, cell amx_addr, int size,
+                     std::vector<cell> &data) {
+  cell *cptr;
+  if (amx_GetAddr(amx, amx_addr, &cptr) != AMX_ERR_NONE) {
+    return false;
+  }
+  if (size < 0) {
+    int length;
+    amx_StrLen(cptr, &length);
+    if (static_cast<ucell>(*cptr) > UNPACKEDMAX) {
+      size = (length + sizeof(cell)) / sizeof(cell);
+    } else {
+      size = length + 1;
+    }
+  }
+  data.assign(cptr, cptr + size);
+  return true;
+}
+
+// SetTimer(const funcname[], interval, bool: repeating)
+cell AMX_NATIVE_CALL n_SetTimer(AMX *amx, const cell *params) {
+  if (params[0] < static_cast<cell>(3 * sizeof(cell))) {
+    return 0;
+  }
+  Timer *timer = NewTimer(amx, params);
+  if (timer == nullptr) {
+    return 0;
+  }
+  return AddTimer(timer);
+}
+
+// SetTimerEx(const funcname[], interval, bool: repeating,
+//            const format[], {Float, _}: ...)
+cell AMX_NATIVE_CALL n_SetTimerEx(AMX *amx, const cell *params) {
+  if (params[0] < static_cast<cell>(4 * sizeof(cell))) {
+    return 0;
+  }
+  char *format;
+  amx_StrParam(amx, params[4], format);
+
+  Timer *timer = NewTimer(amx, params);
+  if (timer == nullptr) {
+    return 0;
+  }
+
+  // Variable arguments are passed by reference.
+  int num_args = static_cast<int>(params[0] / sizeof(cell)) - 4;
+  const cell *args = params + 5;
+  for (int i = 0; format != nullptr && format[i] != '\0'; i++) {
+    if (i >= num_args) {
+      delete timer;
+      return 0;
+    }
+    cell *cptr;
+    if (amx_GetAddr(amx, args[i], &cptr) != AMX_ERR_NONE) {
+      delete timer;
+      return 0;
+    }
+    Argument arg;
+    arg.is_array = false;
+    arg.value = *cptr;
+    switch (format[i]) {
+      case 'b':
+      case 'c':
+      case 'd':
+      case 'f':
+      case 'i':
+      case 'x':
+        break;
+      case 's':
+        arg.is_array = true;
+        if (!GetArgumentData(amx, args[i], -1, arg.data)) {
+          delete timer;
+          return 0;
+        }
+        break;
+      case 'a': {
+        // The size of the array must follow it, as in "ai".
+        cell *size;
+        if (i + 1 >= num_args
+            || (format[i + 1] != 'd' && format[i + 1] != 'i')
+            || amx_GetAddr(amx, args[i + 1], &size) != AMX_ERR_NONE
+            || *size <= 0) {
+          delete timer;
+          return 0;
+        }
+        arg.is_array = true;
+        if (!GetArgumentData(amx, args[i], *size, arg.data)) {
+          delete timer;
+          return 0;
+        }
+        break;
+      }
+      default:
+        delete timer;
+        return 0;
+    }
+    timer->args.push_back(std::move(arg));
+  }
+  return AddTimer(timer);
+}
+
+// bool: KillTimer(timerid)
+cell AMX_NATIVE_CALL n_KillTimer(AMX *amx, const cell *params) {
+  auto iterator = timers.find(params[1]);
+  if (iterator == timers.end() || iterator->second->amx != amx) {
+    return 0;
+  }
+  Timer *timer = iterator->second;
+  if (timer == running) {
+    running_killed = true;
+  } else {
+    Unlink(timer);
+    DeleteTimer(timer);
+  }
+  return 1;
+}
+
+} // anonymous namespace
+
+int TimersInit(AMX *amx) {
+  static const AMX_NATIVE_INFO natives[] = {
+    "SetTimer", n_SetTimer,
+    "SetTimerEx", n_SetTimerEx,
+    "KillTimer", n_KillTimer
+  };
+  int num_natives = static_cast<int>(sizeof(natives) / sizeof(natives[0]));
+  return amx_Register(amx, natives, num_natives);
+}
+
+int TimersCleanup(AMX *amx) {
+  for (auto iterator = timers.begin(); iterator != timers.end(); ) {
+    Timer *timer = iterator->second;
+    if (timer->amx == amx && timer != running) {
+      Unlink(timer);
+      delete timer;
+      iterator = timers.erase(iterator);
+    } else {
+      ++iterator;
+    }
+  }
+  return AMX_ERR_NONE;
+}
+
+bool HasActiveTimers() {
+  return !timers.empty();
+}
+
+void ProcessTimers() {
+  std::uint64_t now = Now();
+  while (current_time <= now) {
+    if (timers.empty()) {
+      current_time = now + 1;
+      break;
+    }
+    int slot = current_time & (ROOT_SIZE - 1);
+    if (slot == 0) {
+      for (int level = 0; level < NUM_LEVELS && Cascade(level) == 0;
+           level++) {
+      }
+    }
+
+    // Timers set or rescheduled by the callbacks go to later slots.
+    expired = root[slot];
+    root[slot] = nullptr;
+    if (expired != nullptr) {
+      expired->pprev = &expired;
+    }
+    current_time++;
+    while (expired != nullptr) {
+      Timer *timer = expired;
+      Unlink(timer);
+      RunTimer(timer, now);
+    }
+  }
+}
@@ -0,0 +1,340 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.h"
+#include "plugincommon.h"
+#include "watchdog.h"
+
+namespace {
+
+using ExecFunction = int (AMXAPI *)(AMX *amx, cell *retval, int index);
+using ExecCallFunction = int (AMXAPI *)(const AMX_CALL *call,
+                                        cell *retval,
+                                        const cell args[],
+                                        int numargs);
+
+// Stack frames to log at most, in case the stack is very deep or corrupt.
+const int MAX_FRAMES = 32;
+
+// The outermost watched call running on a thread; "start" is 0 when there
+// is none. The watchdog thread reads "start" and "reported" only.
+struct Call {
+  Call();
+  ~Call();
+
+  int depth = 0;
+  AMX *amx = nullptr;
+  int index = 0;
+  std::atomic<std::int64_t> start{0};
+  std::atomic<bool> reported{false};
+};
+
+std::mutex mutex;
+std::condition_variable wake_up;
+std::vector<Call *> calls;
+std::thread watchdog_thread;
+bool stop = false;
+
+bool enabled = false;
+std::int64_t budget_ns = 0;
+bool abort_long_calls = false;
+ExecFunction next_exec = amx_Exec;
+ExecCallFunction next_exec_call = amx_ExecCall;
+
+thread_local Call current_call;
+
+Call::Call() {
+  std::lock_guard<std::mutex> lock(mutex);
+  calls.push_back(this);
+}
+
+Call::~Call() {
+  std::lock_guard<std::mutex> lock(mutex);
+  calls.erase(std::remove(calls.begin(), calls.end(), this), calls.end());
+}
+
+std::int64_t Now() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+void Log(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  LogVPrintf(format, args);
+  va_end(args);
+}
+
+unsigned char *GetData(AMX *amx) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  return amx->data != nullptr ? amx->data : amx->base + hdr->dat;
+}
+
+cell ReadCell(const unsigned char *base, cell addr) {
+  return *reinterpret_cast<const cell *>(base + addr);
+}
+
+// Returns the name of the public function (or main) that starts at the
+// given code address or, if "containing" is set, the last one that starts
+// before it. Functions that are not public have no name in the AMX file.
+std::string GetFunctionName(AMX *amx, cell address, bool containing) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  std::string name;
+  cell best = -1;
+  if (hdr->cip >= 0 && (hdr->cip == address
+                        || (containing && hdr->cip < address))) {
+    best = hdr->cip;
+    name = "main";
+  }
+  int num_publics = 0;
+  amx_NumPublics(amx, &num_publics);
+  for (int i = 0; i < num_publics; i++) {
+    auto entry = reinterpret_cast<AMX_FUNCSTUB *>(
+      amx->base + hdr->publics + i * hdr->defsize);
+    auto start = static_cast<cell>(entry->address);
+    if ((start == address || (containing && start < address))
+        && start > best) {
+      char public_name[sNAMEMAX + 1];
+      if (amx_GetPublic(amx, i, public_name) == AMX_ERR_NONE) {
+        best = start;
+        name = public_name;
+      }
+    }
+  }
+  if (name.empty()) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "<function at %08x>",
+                  static_cast<unsigned int>(address));
+    name = buffer;
+  }
+  return name;
+}
+
+std::string GetCallName(AMX *amx, int index) {
+  if (index == AMX_EXEC_MAIN) {
+    return "main";
+  }
+  if (index == AMX_EXEC_CONT) {
+    return "(continued call)";
+  }
+  char name[sNAMEMAX + 1];
+  if (amx_GetPublic(amx, index, name) != AMX_ERR_NONE) {
+    return "(" + std::to_string(index) + ")";
+  }
+  return name;
+}
+
+// Logs the call stack from the registers that amx_Exec() saved before
+// calling the interrupt handler. Each frame holds the frame pointer of the
+// caller and the return address; the start of a function is the operand of
+// the CALL instruction before the return address in its caller. A zero
+// return address marks the frame that amx_Exec() entered, which is that of
+// a public function.
+void LogCallStack(AMX *amx) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  const unsigned char *code = amx->base + hdr->cod;
+  const unsigned char *data = GetData(amx);
+  cell code_size = hdr->dat - hdr->cod;
+  cell address = amx->cip;
+  cell frm = amx->frm;
+
+  for (int depth = 0; depth < MAX_FRAMES; depth++) {
+    if (frm < amx->stk
+        || frm > amx->stp - 3 * static_cast<cell>(sizeof(cell))) {
+      break;
+    }
+    cell return_address = ReadCell(data, frm + sizeof(cell));
+    if (return_address == 0) {
+      Log("#%d %08x in %s", depth, static_cast<unsigned int>(address),
+          GetFunctionName(amx, address, true).c_str());
+      cell args_size = ReadCell(data, frm + 2 * sizeof(cell));
+      if (frm + 3 * static_cast<cell>(sizeof(cell)) + args_size < amx->stp) {
+        Log("#%d (called from a native)", depth + 1);
+      }
+      break;
+    }
+    if (return_address < static_cast<cell>(sizeof(cell))
+        || return_address > code_size) {
+      break;
+    }
+    // The interpreter may have relocated jump targets to absolute
+    // addresses.
+    auto target = static_cast<std::uintptr_t>(
+      static_cast<ucell>(ReadCell(code, return_address - sizeof(cell))));
+    auto code_start = reinterpret_cast<std::uintptr_t>(code);
+    if (target >= code_start && target - code_start < static_cast<ucell>(code_size)) {
+      target -= code_start;
+    }
+    Log("#%d %08x in %s", depth, static_cast<unsigned int>(address),
+        GetFunctionName(amx, static_cast<cell>(target), false).c_str());
+    address = return_address;
+    frm = ReadCell(data, frm);
+  }
+}
+
+int AMXAPI OnInterrupt(AMX *amx) {
+  std::int64_t start = current_call.start;
+  if (start == 0) {
+    return AMX_ERR_NONE;
+  }
+  std::int64_t time = Now() - start;
+  if (time <= budget_ns) {
+    return AMX_ERR_NONE;
+  }
+  if (!current_call.reported) {
+    current_call.reported = true;
+    Log("Long call to %s: %.3f ms, over the budget of %.3f ms",
+        GetCallName(current_call.amx, current_call.index).c_str(),
+        time / 1000000.0,
+        budget_ns / 1000000.0);
+    LogCallStack(amx);
+    if (!abort_long_calls) {
+      amx_Interrupt(0);
+    }
+  }
+  return abort_long_calls ? AMX_ERR_EXIT : AMX_ERR_NONE;
+}
+
+void EnterCall(AMX *amx, int index) {
+  if (current_call.depth++ == 0) {
+    current_call.amx = amx;
+    current_call.index = index;
+    current_call.reported = false;
+    current_call.start = Now();
+  }
+}
+
+void LeaveCall() {
+  if (--current_call.depth == 0) {
+    current_call.start = 0;
+  }
+}
+
+int AMXAPI WatchExec(AMX *amx, cell *retval, int index) {
+  EnterCall(amx, index);
+  int error = next_exec(amx, retval, index);
+  LeaveCall();
+  return error;
+}
+
+int AMXAPI WatchExecCall(const AMX_CALL *call,
+                         cell *retval,
+                         const cell args[],
+                         int numargs) {
+  EnterCall(call->amx, call->index);
+  int error = next_exec_call(call, retval, args, numargs);
+  LeaveCall();
+  return error;
+}
+
+// Polls the running calls a few times per budget and keeps an interrupt
+// pending while one of them is over it and has not been dealt with.
+void Watch() {
+  auto interval = std::chrono::nanoseconds(
+    std::min<std::int64_t>(std::max<std::int64_t>(budget_ns / 4, 1000000),
+                           100000000));
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!wake_up.wait_for(lock, interval, [] { return stop; })) {
+    std::int64_t now = Now();
+    bool overdue = false;
+    for (Call *c : calls) {
+      std::int64_t start = c->start;
+      if (start != 0
+          && now - start > budget_ns
+          && (abort_long_calls || !c->reported)) {
+        overdue = true;
+      }
+    }
+    amx_Interrupt(overdue);
+  }
+}
+
+} // anonymous namespace
+
+void StartWatchdog(void **amx_functions,
+                   std::uint64_t budget_us,
+                   bool abort_calls) {
+  budget_ns = static_cast<std::int64_t>(budget_us) * 1000;
+  abort_long_calls = abort_calls;
+  next_exec = reinterpret_cast<ExecFunction>(
+    amx_functions[PLUGIN_AMX_EXPORT_Exec]);
+  next_exec_call = reinterpret_cast<ExecCallFunction>(
+    amx_functions[PLUGIN_AMX_EXPORT_ExecCall]);
+  amx_functions[PLUGIN_AMX_EXPORT_Exec] = (void *)WatchExec;
+  amx_functions[PLUGIN_AMX_EXPORT_ExecCall] = (void *)WatchExecCall;
+  amx_SetInterrupt(OnInterrupt);
+  enabled = true;
+  watchdog_thread = std::thread(Watch);
+}
+
+void StopWatchdog() {
+  if (!enabled) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake_up.notify_one();
+  watchdog_thread.join();
+  amx_Interrupt(0);
+  amx_SetInterrupt(nullptr);
+}
+
+void RestartWatchdogAfterFork() {
+  if (!enabled) {
+    return;
+  }
+  // The parent's thread may have held the mutex at the time of the fork, and
+  // the calls of its other threads are gone. The old thread object is left
+  // alone, it can't be joined.
+  new (&mutex) std::mutex;
+  new (&wake_up) std::condition_variable;
+  calls.assign(1, &current_call);
+  std::thread(Watch).detach();
+}
+
+int WatchedExec(AMX *amx, cell *retval, int index) {
+  if (!enabled) {
+    return amx_Exec(amx, retval, index);
+  }
+  EnterCall(amx, index);
+  int error = amx_Exec(amx, retval, index);
+  LeaveCall();
+  return error;
+}
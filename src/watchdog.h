@@ -0,0 +1,57 @@
+// Copyright (c) 2019 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <cstdint>
+#include "amx/amx.h"
+
+// Reports script calls that take longer than a time budget, like the
+// long_call_time option of crashdetect. A background thread keeps an eye on
+// the calls made through WatchedExec() and through the amx_Exec() and
+// amx_ExecCall() functions given to plugins; calls nested in another one are
+// part of it. When a call runs over the budget, the thread interrupts the
+// script, which logs its call stack (with the names of public functions
+// where they are known) at the next function entry or jump and, if asked
+// to, fails with AMX_ERR_EXIT. A call stuck in a native is only reported
+// once the native returns.
+//
+// It must be started before the plugins are loaded, as they may keep the
+// function pointers; functions already in the table (e.g. the profiler's)
+// are called in turn.
+void StartWatchdog(void **amx_functions,
+                   std::uint64_t budget_us,
+                   bool abort_calls);
+void StopWatchdog();
+
+// Starts the watchdog again in a child forked while it was running, where
+// the parent's thread doesn't exist. The child must leave with _exit().
+void RestartWatchdogAfterFork();
+
+// Same as amx_Exec(), but watched if the watchdog is running.
+int WatchedExec(AMX *amx, cell *retval, int index);
+
+#endif // !WATCHDOG_H